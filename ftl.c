@@ -11,39 +11,126 @@
  * http://nyx.skku.ac.kr
  */
 
-#include "ftl3.h"
+#define _POSIX_C_SOURCE 200809L
+
+/* geometry macros read the device in scope */
+#define FTL_GEO (dev->geo)
+
+#include "ftl.h"
+#include "ftl_addr.h"
+#include "ftl_ring.h"
 #include <stdlib.h> 
 #include <string.h>
 #include <stdio.h>
 #include <stdbool.h>
-
-#define N_GC_BLOCKS 1
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+
+/* map pages loaded ahead of a detected strided miss stream */
+#ifndef PREFETCH_DEPTH
+#define PREFETCH_DEPTH 2
+#endif
+/* strided misses in a row before prefetch starts */
+#ifndef PREFETCH_TRIGGER
+#define PREFETCH_TRIGGER 2
+#endif
+
+/* page ops a bank worker can queue before the host waits */
+#ifndef WORKER_RING_SIZE
+#define WORKER_RING_SIZE 256
+#endif
+/* empty polls before a bank worker sleeps */
+#ifndef WORKER_SPIN
+#define WORKER_SPIN 64
+#endif
+/* GCs of a bank between two looks of the block split controller */
+#ifndef SPLIT_WINDOW
+#define SPLIT_WINDOW 64
+#endif
+/* the window doubles after each bad move, up to this */
+#ifndef SPLIT_WINDOW_MAX
+#define SPLIT_WINDOW_MAX 4096
+#endif
+/* empty blocks a bank keeps before the split controller moves one */
+#ifndef SPLIT_RESERVE
+#define SPLIT_RESERVE 2
+#endif
+/* host commands between two looks of the DRAM split controller */
+#ifndef DRAM_INTERVAL
+#define DRAM_INTERVAL 1024
+#endif
+/* the DRAM budget moves in steps of 1 / DRAM_STEPS of it */
+#ifndef DRAM_STEPS
+#define DRAM_STEPS 32
+#endif
 
 #define DATA_BLOCK 1
 #define TR_BLOCK 2
 
+typedef unsigned short u16;
+
+/* valid sectors of a page, bit k for sector k */
+typedef u32 SECTOR_MASK;
+typedef char sector_mask_fits[SECTORS_PER_PAGE <= 32 ? 1 : -1];
+#define SECTOR_MASK_ALL	((SECTOR_MASK)((1ull << SECTORS_PER_PAGE) - 1))
+
+/*
+ * Map page, raw or extent encoded
+ *
+ * A map page is kept as a list of (ppn, offset, len) extents when
+ * consecutive LPNs map to consecutive PPNs. Single entries are just
+ * extents of len 1, unmapped entries are left out and len 0 ends
+ * the list. Pages with too many extents stay raw. The same image is
+ * held in CMT and written to flash, MAP_EXTENT_FLAG in the spare
+ * tells which encoding a translation page uses.
+ */
+typedef struct MAP_EXTENT{
+	u32 ppn;
+	u16 offset;
+	u16 len;
+}MAP_EXTENT;
+
+#define N_MAP_EXTENTS_PER_PAGE		(PAGE_DATA_SIZE / sizeof(MAP_EXTENT))
+#define MAP_EXTENT_FLAG				0x80000000
+
+typedef union MAP_PAGE{
+	u32 entry[N_MAP_ENTRIES_PER_PAGE];
+	MAP_EXTENT extent[N_MAP_EXTENTS_PER_PAGE];
+}MAP_PAGE;
+
 /*
  * CMT, GTD
+ *
+ * CMT is limited by bytes (dev->cmt_budget, CMT_BUDGET_PB unless
+ * geo.adaptive_dram), not by slots. A fully sequential map page costs
+ * one extent, so up to N_MAP_EXTENTS_PER_PAGE times more map pages fit
+ * than raw.
  */
 typedef struct {
 	bool valid;
 	u32 map_page;
-	u32 map_entry[N_MAP_ENTRIES_PER_PAGE];
+	MAP_PAGE map;
+	bool compressed;
+	u32 size;
 	bool dirty;
+	bool prefetched;
 	u32 ref_time;
 }CMT_t;
 
-CMT_t **CMT;
-static u32 GTD[N_BANKS][N_MAP_PAGES_PB];
+#define CMT_BUDGET_PB				((CMT_SIZE_PB < PAGE_DATA_SIZE) ? (PAGE_DATA_SIZE) : (CMT_SIZE_PB))
+#define N_CMT_SLOTS_PB				(N_CACHED_MAP_PAGE_PB * N_MAP_EXTENTS_PER_PAGE)
+
 
 /*
- * Buffer
+ * Map prefetch (stride detector per bank)
  */
-u32 **buffer;
-u32 *buffer_list;
-u32 *buffer_count;
-bool **buffer_sector_valid;
-
+typedef struct PREFETCH_STATE{
+	u32 last_map_page;
+	int stride;
+	u32 run;
+}PREFETCH_STATE;
 
 /*
  * State of physical memory
@@ -59,18 +146,290 @@ typedef struct BLOCK_STATE{
 	bool full;
 }BLOCK_STATE;
 
-PAGE_STATE ***page_state;
-BLOCK_STATE **blk_state;
+/*
+ * Superblock, a stripe of one data block per bank
+ *
+ * Pages are written to the banks in turn, page row by page row, and
+ * GC collects and erases a whole stripe.
+ */
+typedef struct SUPERBLOCK{
+	u32 *block;		// block in each bank, block[0] == -1 if the stripe is unused
+	u32 nvalid;
+	bool full;
+}SUPERBLOCK;
+
+/*
+ * Data / translation block split of a bank
+ *
+ * Data GC starts when data_blocks - N_GC_BLOCKS data blocks are full,
+ * map GC likewise with map_blocks. Fixed at N_USER_BLOCKS_PB and
+ * N_MAP_BLOCKS_PB unless geo.adaptive_split, see split_update.
+ */
+typedef struct BANK_SPLIT{
+	u32 data_blocks;
+	u32 map_blocks;
+	u32 events;				// GCs since the last look
+	u32 window;				// GCs between two looks
+	struct ftl_stats last;	// bank stats at the last look
+	double waf;				// of the last window, 0 before the first
+	int dir;				// next move, 1 to data, -1 to map
+	bool moved;				// a block moved at the last look
+	struct ftl_split_sample *history;
+	int n_history;
+	int history_size;
+}BANK_SPLIT;
+
+/*
+ * Page of a batch, sorted by bank, map page and LPN (batch_entry_cmp)
+ *
+ * slot is the buffer slot of a batch flush (buffer_flush_batch) or the
+ * page index in the request of a batch read (read_start).
+ */
+typedef struct BATCH_ENTRY{
+	u32 bank;
+	u32 map_page;
+	u32 lpn;
+	int slot;
+}BATCH_ENTRY;
+
+/*
+ * Page op, the unit of work of a bank
+ *
+ * ftl_read/ftl_write split requests into page ops on the LPN's bank.
+ * Ops of one bank run in order, ops of different banks may run at the
+ * same time. pending (if set) and the device's inflight count are
+ * decremented when the op is done.
+ */
+#define PAGE_OP_READ	0	// read the n pages of batch into out, see read_batch
+#define PAGE_OP_FLUSH	1	// merge valid sectors of data over flash and write
+#define PAGE_OP_STOP	2	// end the worker
+
+typedef struct PAGE_OP{
+	u32 type;
+	u32 lpn;
+	u32 ref_time;
+	u32 *out;
+	int *pending;
+	const BATCH_ENTRY *batch;		// PAGE_OP_READ, pages of the bank of lpn
+	u32 n;
+	u32 data[SECTORS_PER_PAGE];
+	SECTOR_MASK valid;
+}PAGE_OP;
+
+/*
+ * Bank worker, owns banks with bank % n_workers == its index.
+ * The host thread is the only producer of its ring.
+ */
+typedef struct FTL_WORKER{
+	struct ftl_device *dev;
+	pthread_t thread;
+	struct ftl_ring ring;
+	sem_t wake;
+	int sleeping;
+	unsigned long submitted;		// ops pushed, by the host under host_lock
+	unsigned long done;				// ops run, see wait_queued_ops
+}FTL_WORKER;
+
+/*
+ * LPN -> slot index of the write buffer and the read cache
+ *
+ * Open addressing with linear probing, kept at most half full.
+ */
+typedef struct LPN_SLOT{
+	u32 lpn;						// -1 if empty
+	int slot;
+}LPN_SLOT;
+
+typedef struct LPN_INDEX{
+	LPN_SLOT *entry;
+	u32 mask;
+}LPN_INDEX;
+
+/*
+ * List over a pool of slots, linked through the pool's prev / next
+ */
+typedef struct SLOT_LIST{
+	int first;						// -1 if empty
+	int last;
+	int n;
+}SLOT_LIST;
+
+/*
+ * Ghost list, keys lately dropped from a cache, oldest first
+ *
+ * A hit on a ghost is a miss that size more entries of cache would
+ * have saved, see dram_update. Size 0 turns the list off.
+ */
+typedef struct GHOST_LIST{
+	u32 *key;						// ring of size keys, -1 if taken back
+	int size;
+	int head;						// oldest
+	int n;
+	LPN_INDEX index;				// key -> ring position
+	long hits;
+}GHOST_LIST;
+
+/*
+ * Clean read cache, geo.read_cache pages with 2Q replacement
+ *
+ * A page read from flash enters a1in, a FIFO of pages seen once. A page
+ * pushed out of a1in leaves its LPN behind in a1out, a FIFO of ghosts
+ * without data. A miss on a ghost means the page was wanted again soon,
+ * and it goes into am, an LRU of pages seen more than once. Writes
+ * update cached pages in place, so the cache always holds current data.
+ */
+#define RC_A1IN		0
+#define RC_AM		1
+#define RC_A1OUT	2
+
+typedef struct READ_CACHE{
+	int size;						// pages with data, a1in + am
+	int capacity;					// largest size the pool can take
+	int kin;						// a1in size before am gives up pages
+	int kout;						// ghosts kept
+	u32 *data;						// SECTORS_PER_PAGE per slot
+	u32 *lpn;
+	int *queue;						// RC_* of each slot
+	int *prev;
+	int *next;
+	SLOT_LIST q[3];
+	int free;						// free slots chained by next
+	LPN_INDEX index;				// cached pages and ghosts
+	u32 gen;						// bumped by every host write
+	GHOST_LIST dropped;				// pages whose data left the cache
+}READ_CACHE;
 
+/*
+ * FTL instance
+ *
+ * Everything one simulated drive needs, so that several can run in
+ * one process.
+ */
+struct ftl_device {
+	struct ftl_geometry geo;
+	struct ftl_stats stats;			// host_stats plus bank_stats, see ftl_get_stats
+	struct ftl_stats host_stats;
+	struct nand_device *nand;
+	pthread_mutex_t host_lock;		// write buffer and page op submission
+
+	// Bank workers
+	int n_workers;
+	FTL_WORKER *workers;
+	int inflight;
+	int done_waiters;				// threads asleep on done_cond
+	pthread_mutex_t done_lock;
+	pthread_cond_t done_cond;		// broadcast when a page op ends
+	struct ftl_stats *bank_stats;
+	u32 *bank_ref_time;				// ref_time of the op running on the bank
+
+	// CMT, GTD
+	CMT_t **CMT;
+	int n_cmt_slots;				// per bank
+	u32 cmt_budget;					// bytes per bank
+	u32 *CMT_used;
+	u32 **GTD;
+	PREFETCH_STATE *prefetch_state;
+
+	// Buffer, a pool of buffer_slots slots that never move
+	int buffer_slots;
+	int buffer_size;				// slots in use at most, N_BUFFERS unless geo.adaptive_dram
+	u32 **buffer;
+	u32 *buffer_list;				// LPN of each slot, -1 if free
+	u32 buffer_count;
+	SECTOR_MASK *buffer_valid;
+	LPN_INDEX buffer_index;
+	int *buffer_prev;
+	int *buffer_next;
+	SLOT_LIST buffer_order;			// eviction order, see buffer_evict
+	int buffer_free;				// free slots chained by buffer_next
+	BATCH_ENTRY *flush_batch;		// geo.flush_watermark
+	int *flush_taken;				// pages of the batch per bank
+	u32 *flush_map_page;			// the one map page of each bank in the batch
+	READ_CACHE rcache;
+	u32 seq_end;					// lba after the last host write
+	u32 seq_run;					// sectors of the sequential run it ended
+
+	// DRAM split (geo.adaptive_dram), see dram_update
+	int dram_pages;					// write buffer + read cache + CMT of all banks
+	int dram_step;
+	long host_cmds;
+	GHOST_LIST buffer_ghost;
+	GHOST_LIST *cmt_ghost;			// per bank
+	struct ftl_dram_sample *dram_history;
+	int n_dram_history;
+	int dram_history_size;
+
+	// State of physical memory
+	PAGE_STATE ***page_state;
+	BLOCK_STATE **blk_state;
+	u32 *current_block_map;
+	u32 *current_block_user;
+	u32 *bank_valid;				// valid data pages per bank
+
+	// Superblocks (geo.superblock)
+	SUPERBLOCK *sb;					// at most BLKS_PER_BANK stripes
+	int **blk_sb;					// stripe of each block, -1 if none
+	int sb_open;					// stripe being written, -1 if none
+	u32 sb_next;					// next page of it, bank = sb_next % N_BANKS
+	u32 sb_full;
+
+	BANK_SPLIT *split;
 
-u32 current_block_map[N_BANKS];
-u32 current_block_user[N_BANKS];
+	u32 ref_time;
+};
 
-static u32 ref_time = 0;
+/*
+ * Host read in flight, see read_start
+ */
+typedef struct READ_REQ{
+	u32 lba;
+	u32 nsect;
+	u32 *out;
+	u32 *flash;						// pages read from the banks
+	SECTOR_MASK *from_buffer;		// per page, sectors found in DRAM
+	BATCH_ENTRY *batch;				// pages read from flash
+	u32 gen;						// rcache.gen at the start
+	int pending;
+}READ_REQ;
+
+typedef struct QP_READ{
+	bool busy;
+	u32 tag;
+	READ_REQ req;
+}QP_READ;
 
-static void map_garbage_collection(u32 bank);
-void write(u32 lba, u32 nsect, u32 *write_buf);
-void read(u32 lba, u32 nsect, u32 *read_buf);
+/*
+ * Queue pair
+ *
+ * The rings are only touched by the thread that uses the queue pair,
+ * commands are started under the device's host_lock.
+ */
+struct ftl_qpair {
+	struct ftl_device *dev;
+	int depth;
+	int outstanding;				// submitted and not yet reaped
+	struct ftl_ring sq;
+	struct ftl_ring cq;
+	QP_READ *reads;					// depth slots for started reads
+	unsigned long *mark;			// see wait_queued_ops
+};
+
+static void map_garbage_collection(struct ftl_device *dev, u32 bank);
+static void split_init(struct ftl_device *dev, u32 bank);
+static void split_update(struct ftl_device *dev, u32 bank);
+static void lpn_index_init(LPN_INDEX *idx, int n);
+static void rcache_init(READ_CACHE *rc, int size, int capacity);
+static void rcache_free(READ_CACHE *rc);
+static void ghost_init(GHOST_LIST *g, int size);
+static void ghost_free(GHOST_LIST *g);
+static void ghost_add(GHOST_LIST *g, u32 key);
+static void ghost_hit(GHOST_LIST *g, u32 key);
+static void dram_init(struct ftl_device *dev);
+static void dram_record(struct ftl_device *dev);
+static void dram_tick(struct ftl_device *dev);
+static void write(struct ftl_device *dev, u32 lba, u32 nsect, u32 *write_buf);
+static void read(struct ftl_device *dev, u32 lba, u32 nsect, u32 *read_buf);
+static void read_batch(struct ftl_device *dev, u32 bank, const PAGE_OP *op);
 /* DFTL simulator
  * you must make CMT, GTD to use L2P cache
  * you must increase stats.cache_hit value when L2P is in CMT
@@ -79,20 +438,118 @@ void read(u32 lba, u32 nsect, u32 *read_buf);
  */
 
 
+/*
+ *	Encode map entries into a map page, returns true if extent encoded
+ */
+static bool encode_map(const u32 *entry, MAP_PAGE *map)
+{
+	u32 n = 0;
+
+	for (int i = 0; i < N_MAP_ENTRIES_PER_PAGE; i++) {
+		if (entry[i] == -1)
+			continue;
+
+		if (n > 0) {
+			MAP_EXTENT *last = &map->extent[n - 1];
+			if (last->offset + last->len == i && last->ppn + last->len == entry[i]) {
+				last->len++;
+				continue;
+			}
+		}
+
+		// no room left for the terminator, keep it raw
+		if (n == N_MAP_EXTENTS_PER_PAGE - 1) {
+			memcpy(map->entry, entry, PAGE_DATA_SIZE);
+			return false;
+		}
+		map->extent[n].ppn = entry[i];
+		map->extent[n].offset = i;
+		map->extent[n].len = 1;
+		n++;
+	}
+
+	memset(&map->extent[n], 0, sizeof(MAP_EXTENT) * (N_MAP_EXTENTS_PER_PAGE - n));
+	return true;
+}
+
+static void decode_map(const MAP_PAGE *map, bool compressed, u32 *entry)
+{
+	if (!compressed) {
+		memcpy(entry, map->entry, PAGE_DATA_SIZE);
+		return;
+	}
+
+	memset(entry, -1, PAGE_DATA_SIZE);
+	for (int k = 0; k < N_MAP_EXTENTS_PER_PAGE && map->extent[k].len != 0; k++) {
+		for (int i = 0; i < map->extent[k].len; i++)
+			entry[map->extent[k].offset + i] = map->extent[k].ppn + i;
+	}
+}
+
+static u32 lookup_map(const MAP_PAGE *map, bool compressed, u32 map_offset)
+{
+	if (!compressed)
+		return map->entry[map_offset];
+
+	for (int k = 0; k < N_MAP_EXTENTS_PER_PAGE && map->extent[k].len != 0; k++) {
+		const MAP_EXTENT *ext = &map->extent[k];
+		if (map_offset >= ext->offset && map_offset < ext->offset + ext->len)
+			return ext->ppn + (map_offset - ext->offset);
+	}
+	return -1;
+}
+
+static void update_map(MAP_PAGE *map, bool *compressed, u32 map_offset, u32 ppn)
+{
+	u32 entry[N_MAP_ENTRIES_PER_PAGE];
+
+	decode_map(map, *compressed, entry);
+	entry[map_offset] = ppn;
+	*compressed = encode_map(entry, map);
+}
+
+/*
+ *	Recount the bytes a CMT slot takes from the budget
+ */
+static void size_CMT(struct ftl_device *dev, u32 bank, u32 cache_slot)
+{
+	CMT_t *slot = &dev->CMT[bank][cache_slot];
+	u32 size = 0;
+
+	if (slot->valid == false) {
+		size = 0;
+	} else if (slot->compressed) {
+		size = sizeof(MAP_EXTENT);
+		for (int k = 1; k < N_MAP_EXTENTS_PER_PAGE && slot->map.extent[k].len != 0; k++)
+			size += sizeof(MAP_EXTENT);
+	} else {
+		size = PAGE_DATA_SIZE;
+	}
+
+	dev->CMT_used[bank] = dev->CMT_used[bank] - slot->size + size;
+	slot->size = size;
+}
+
 /*
  *	Initialize CMT
  */
-static void init_CMT(u32 bank, u32 cache_slot)
+static void init_CMT(struct ftl_device *dev, u32 bank, u32 cache_slot)
 {
-	CMT[bank][cache_slot].dirty = false;
-	memset(CMT[bank][cache_slot].map_entry, -1, MAP_ENTRY_SIZE * N_MAP_ENTRIES_PER_PAGE);
-	CMT[bank][cache_slot].map_page = -1;
-	CMT[bank][cache_slot].ref_time = -1;
-	CMT[bank][cache_slot].valid = false;
+	if (dev->CMT[bank][cache_slot].prefetched == true)
+		dev->bank_stats[bank].prefetch_waste++;
+
+	dev->CMT[bank][cache_slot].prefetched = false;
+	dev->CMT[bank][cache_slot].dirty = false;
+	memset(dev->CMT[bank][cache_slot].map.entry, -1, PAGE_DATA_SIZE);
+	dev->CMT[bank][cache_slot].compressed = false;
+	dev->CMT[bank][cache_slot].map_page = -1;
+	dev->CMT[bank][cache_slot].ref_time = -1;
+	dev->CMT[bank][cache_slot].valid = false;
+	size_CMT(dev, bank, cache_slot);
 	return;
 }
 
-static void map_write(u32 bank, u32 map_page, u32 cache_slot)
+static void map_write(struct ftl_device *dev, u32 bank, u32 map_page, u32 cache_slot)
 {
 	/* you use this function when you must flush
 	 * cache from CMT to NAND MAP area
@@ -100,107 +557,260 @@ static void map_write(u32 bank, u32 map_page, u32 cache_slot)
 	 */
 
 	// get TR block
-	u32 M_ppn = GTD[bank][map_page];
+	u32 M_ppn = dev->GTD[bank][map_page];
 
 	// invalid old translate block
 	if (M_ppn != -1) 
 	{
-		u32 old_bank = M_ppn / N_PPNS_PB;
-		u32 old_block = (M_ppn - (N_PPNS_PB * bank)) / PAGES_PER_BLK;
-		u32 old_page = (M_ppn - (N_PPNS_PB * bank)) % PAGES_PER_BLK;
+		u32 old_bank = ppn_bank(&dev->geo, M_ppn);
+		u32 old_block = ppn_block(&dev->geo, M_ppn);
+		u32 old_page = ppn_page(&dev->geo, M_ppn);
 
-		page_state[old_bank][old_block][old_page].valid = false;
-		(blk_state[old_bank][old_block].nvalid)--;
+		dev->page_state[old_bank][old_block][old_page].valid = false;
+		(dev->blk_state[old_bank][old_block].nvalid)--;
 	}
 
 	// map garbage collection trigger
 	u32 nfull_tr = 0;
 	for (int j = 0 ; j < BLKS_PER_BANK ; j++) {
-		if (blk_state[bank][j].full == true 
-			&& blk_state[bank][j].area == TR_BLOCK) 
+		if (dev->blk_state[bank][j].full == true 
+			&& dev->blk_state[bank][j].area == TR_BLOCK) 
 			nfull_tr++;
 	}
 
-	if (nfull_tr == N_MAP_BLOCKS_PB - N_GC_BLOCKS) {
-		map_garbage_collection(bank);
+	if (nfull_tr >= dev->split[bank].map_blocks - N_GC_BLOCKS) {
+		map_garbage_collection(dev, bank);
 	}
 	
 	u32 M_block = 0;
 	u32 M_page = 0;
 
 	// find new map ppn
-	if (current_block_map[bank] == -1) {
+	if (dev->current_block_map[bank] == -1) {
 		M_block = 0;
-		while (blk_state[bank][M_block].full == true
-				|| blk_state[bank][M_block].area == DATA_BLOCK) 
+		while (dev->blk_state[bank][M_block].full == true
+				|| dev->blk_state[bank][M_block].area == DATA_BLOCK) 
 			M_block++;
-		current_block_map[bank] = M_block;
+		dev->current_block_map[bank] = M_block;
 	} else {
-		M_block = current_block_map[bank];
+		M_block = dev->current_block_map[bank];
 	}
-	blk_state[bank][M_block].area = TR_BLOCK;
+	dev->blk_state[bank][M_block].area = TR_BLOCK;
 	
 	M_page = 0;
-	while (page_state[bank][M_block][M_page].write == true) {
+	while (dev->page_state[bank][M_block][M_page].write == true) {
 		M_page++;
 	}
-	M_ppn = (N_PPNS_PB * bank) + (PAGES_PER_BLK * M_block) + M_page;
+	M_ppn = to_ppn(&dev->geo, bank, M_block, M_page);
 
 	// write new translate block
-	u32 *map_entry = malloc(PAGE_DATA_SIZE);
-	memset(map_entry, 0, PAGE_DATA_SIZE);
-
-	for (int i = 0; i < N_MAP_ENTRIES_PER_PAGE; i++) {
-		map_entry[i] = CMT[bank][cache_slot].map_entry[i];
-	}
-
-	u32 *M_vpn = &map_page;
-	nand_write(bank, M_block, M_page, map_entry, M_vpn);
-	stats.map_write++;
+	u32 M_vpn = map_page;
+	if (dev->CMT[bank][cache_slot].compressed)
+		M_vpn |= MAP_EXTENT_FLAG;
 
-	free(map_entry);
+	nand_write(dev->nand, bank, M_block, M_page, &dev->CMT[bank][cache_slot].map, &M_vpn);
+	dev->bank_stats[bank].map_write++;
 
-	page_state[bank][M_block][M_page].write = true;
-	page_state[bank][M_block][M_page].valid = true;
-	(blk_state[bank][M_block].nvalid)++;
+	dev->page_state[bank][M_block][M_page].write = true;
+	dev->page_state[bank][M_block][M_page].valid = true;
+	(dev->blk_state[bank][M_block].nvalid)++;
 
 	if (M_page == PAGES_PER_BLK - 1) {
-		blk_state[bank][M_block].full = true;
-		current_block_map[bank] = -1;
+		dev->blk_state[bank][M_block].full = true;
+		dev->current_block_map[bank] = -1;
 	}
 
 	// modify CMT, GTD
 
-	GTD[bank][map_page] = M_ppn;
-	init_CMT(bank, cache_slot);
+	dev->GTD[bank][map_page] = M_ppn;
+	init_CMT(dev, bank, cache_slot);
 
 	return;
 }
-static void map_read(u32 bank, u32 map_page, u32 cache_slot)
+static void map_read(struct ftl_device *dev, u32 bank, u32 map_page, u32 cache_slot)
 {
 	/* you use this function when you must load 
 	 * L2P from NAND MAP area to CMT
 	 * find L2P MAP with GTD and fill CMT!!
 	 */
 
-	u32 M_ppn = GTD[bank][map_page];
+	u32 M_ppn = dev->GTD[bank][map_page];
 
 	u32 spare_lpn;
 	
-	u32 old_bank = M_ppn / N_PPNS_PB;
-	u32 old_block = (M_ppn - (N_PPNS_PB * bank)) / PAGES_PER_BLK;
-	u32 old_page = (M_ppn - (N_PPNS_PB * bank)) % PAGES_PER_BLK;
+	u32 old_bank = ppn_bank(&dev->geo, M_ppn);
+	u32 old_block = ppn_block(&dev->geo, M_ppn);
+	u32 old_page = ppn_page(&dev->geo, M_ppn);
+
+	nand_read(dev->nand, old_bank, old_block, old_page, &dev->CMT[bank][cache_slot].map, &spare_lpn);
+	dev->bank_stats[bank].map_read++;
+
+	dev->CMT[bank][cache_slot].map_page = map_page;
+	dev->CMT[bank][cache_slot].compressed = (spare_lpn & MAP_EXTENT_FLAG) != 0;
+	dev->CMT[bank][cache_slot].valid = true;
+	dev->CMT[bank][cache_slot].dirty = false;
+	dev->CMT[bank][cache_slot].ref_time = dev->bank_ref_time[bank];
+	size_CMT(dev, bank, cache_slot);
+}
+
+static u32 find_CMT(struct ftl_device *dev, u32 bank, u32 map_page)
+{
+	for (int j = 0; j < dev->n_cmt_slots; j++) {
+		if (dev->CMT[bank][j].valid == true && dev->CMT[bank][j].map_page == map_page)
+			return j;
+	}
+	return -1;
+}
+
+/*
+ *	Flush (if dirty) and drop the LRU slot other than keep_slot.
+ *	With spare_prefetched, not yet used prefetched slots are kept too.
+ *	Returns false if there is nothing to evict.
+ */
+static bool evict_CMT(struct ftl_device *dev, u32 bank, u32 keep_slot, bool spare_prefetched)
+{
+	u32 victim = -1;
+
+	for (int j = 0; j < dev->n_cmt_slots; j++) {
+		if (dev->CMT[bank][j].valid == false || j == keep_slot)
+			continue;
+		if (spare_prefetched && dev->CMT[bank][j].prefetched == true)
+			continue;
+		if (victim == -1 || dev->CMT[bank][j].ref_time < dev->CMT[bank][victim].ref_time)
+			victim = j;
+	}
+
+	if (victim == -1)
+		return false;
+
+	ghost_add(&dev->cmt_ghost[bank], dev->CMT[bank][victim].map_page);
+	if (dev->CMT[bank][victim].dirty == true)
+		map_write(dev, bank, dev->CMT[bank][victim].map_page, victim);
+	else
+		init_CMT(dev, bank, victim);
+
+	return true;
+}
+
+/*
+ *	Get a free CMT slot with room for one raw map page, evicting
+ *	LRU slots if needed. Returns -1 if there is no slot to give.
+ */
+static u32 alloc_CMT_slot(struct ftl_device *dev, u32 bank, u32 keep_slot, bool spare_prefetched)
+{
+	while (1) {
+		u32 vacant = -1;
+		for (int j = 0; j < dev->n_cmt_slots; j++) {
+			if (dev->CMT[bank][j].valid == false) {
+				vacant = j;
+				break;
+			}
+		}
+
+		if (vacant != -1 && dev->CMT_used[bank] + PAGE_DATA_SIZE <= dev->cmt_budget)
+			return vacant;
+
+		if (!evict_CMT(dev, bank, keep_slot, spare_prefetched))
+			return -1;
+	}
+}
+
+/*
+ *	Evict LRU slots until CMT is back under budget after keep_slot grew
+ */
+static void fit_CMT(struct ftl_device *dev, u32 bank, u32 keep_slot)
+{
+	while (dev->CMT_used[bank] > dev->cmt_budget) {
+		if (!evict_CMT(dev, bank, keep_slot, false))
+			break;
+	}
+}
+
+/*
+ *	Bring map_page into CMT (load it, or start an empty one)
+ */
+static u32 load_CMT(struct ftl_device *dev, u32 bank, u32 map_page)
+{
+	u32 slot = alloc_CMT_slot(dev, bank, -1, false);
+
+	if (dev->GTD[bank][map_page] != -1) {
+		ghost_hit(&dev->cmt_ghost[bank], map_page);
+		map_read(dev, bank, map_page, slot);
+	} else {
+		dev->CMT[bank][slot].map_page = map_page;
+		// empty extent list, nothing mapped yet
+		memset(&dev->CMT[bank][slot].map, 0, PAGE_DATA_SIZE);
+		dev->CMT[bank][slot].compressed = true;
+		dev->CMT[bank][slot].valid = true;
+		dev->CMT[bank][slot].dirty = false;
+		dev->CMT[bank][slot].ref_time = dev->bank_ref_time[bank];
+		size_CMT(dev, bank, slot);
+	}
+
+	u32 n_cached = 0;
+	for (int j = 0; j < dev->n_cmt_slots; j++) {
+		if (dev->CMT[bank][j].valid == true)
+			n_cached++;
+	}
+	if (n_cached > dev->bank_stats[bank].cmt_max_cached)
+		dev->bank_stats[bank].cmt_max_cached = n_cached;
+
+	return slot;
+}
+
+/*
+ *	Set one L2P entry of a cached map page
+ */
+static void set_CMT(struct ftl_device *dev, u32 bank, u32 cache_slot, u32 map_offset, u32 ppn)
+{
+	update_map(&dev->CMT[bank][cache_slot].map, &dev->CMT[bank][cache_slot].compressed, map_offset, ppn);
+	dev->CMT[bank][cache_slot].dirty = true;
+	dev->CMT[bank][cache_slot].ref_time = dev->bank_ref_time[bank];
+	size_CMT(dev, bank, cache_slot);
+	fit_CMT(dev, bank, cache_slot);
+}
+
+/*
+ *	Feed a demand map page access to the stride detector and
+ *	load the next map pages of the stream into CMT
+ */
+static void prefetch_map(struct ftl_device *dev, u32 bank, u32 map_page, u32 keep_slot)
+{
+	PREFETCH_STATE *pf = &dev->prefetch_state[bank];
+	int stride = (int)map_page - (int)pf->last_map_page;
+	int depth = PREFETCH_DEPTH;
+
+	if (pf->last_map_page != -1 && stride != 0 && stride == pf->stride) {
+		pf->run++;
+	} else if (stride != 0) {
+		pf->stride = stride;
+		pf->run = 1;
+	}
+	pf->last_map_page = map_page;
 
-	nand_read(old_bank, old_block, old_page, CMT[bank][cache_slot].map_entry, &spare_lpn);
-	stats.map_read++;
+	if (pf->run < PREFETCH_TRIGGER)
+		return;
+
+	for (int k = 1; k <= depth; k++) {
+		long next = (long)map_page + (long)pf->stride * k;
+		if (next < 0 || next >= N_MAP_PAGES_PB)
+			break;
+		if (dev->GTD[bank][next] == -1)
+			continue;
+		if (find_CMT(dev, bank, next) != -1)
+			continue;
 
-	CMT[bank][cache_slot].map_page = map_page;
-	CMT[bank][cache_slot].valid = true;
-	CMT[bank][cache_slot].dirty = false;
-	CMT[bank][cache_slot].ref_time = ref_time;
+		// never push the demand page out
+		u32 slot = alloc_CMT_slot(dev, bank, keep_slot, true);
+		if (slot == -1)
+			break;
+		map_read(dev, bank, next, slot);
+		dev->CMT[bank][slot].prefetched = true;
+		dev->bank_stats[bank].prefetch_read++;
+	}
 }
 
-static void map_garbage_collection(u32 bank)
+static void map_garbage_collection(struct ftl_device *dev, u32 bank)
 {
 	/*stats.map_gc_cnt++ every map_garbage_collection call*/
 	/*stats.map_gc_write++ every nand_write call*/
@@ -212,68 +822,200 @@ static void map_garbage_collection(u32 bank)
 	int page;
 
 	int block = 0;
-	while (blk_state[bank][block].full == true
-			|| blk_state[bank][block].area == DATA_BLOCK) 
+	while (dev->blk_state[bank][block].full == true
+			|| dev->blk_state[bank][block].area == DATA_BLOCK) 
 	{
 		block++;
 	}
-	current_block_map[bank] = block;
-	blk_state[bank][block].area = TR_BLOCK;
+	dev->current_block_map[bank] = block;
+	dev->blk_state[bank][block].area = TR_BLOCK;
 
 
 
 	for (int j = 0 ; j < BLKS_PER_BANK ; j++) {
-		if (blk_state[bank][j].full == true && 
-		   (blk_state[bank][j].nvalid < min_nvalid) &&
-		   blk_state[bank][j].area == TR_BLOCK) 
+		if (dev->blk_state[bank][j].full == true && 
+		   (dev->blk_state[bank][j].nvalid < min_nvalid) &&
+		   dev->blk_state[bank][j].area == TR_BLOCK) 
 		{
-			min_nvalid = blk_state[bank][j].nvalid;
+			min_nvalid = dev->blk_state[bank][j].nvalid;
 			victim = j;
 		}
 	}
 
 	for (int j = 0 ; j < PAGES_PER_BLK ; j++) {
-		if (page_state[bank][victim][j].valid == true) {
-			nand_read(bank, victim, j, valid_page, &M_vpn);
-			stats.map_gc_read ++;
+		if (dev->page_state[bank][victim][j].valid == true) {
+			nand_read(dev->nand, bank, victim, j, valid_page, &M_vpn);
+			dev->bank_stats[bank].map_gc_read ++;
+
+			// destination filled up (it may start partly written), take another
+			if (dev->blk_state[bank][block].full == true) {
+				block = 0;
+				while (dev->blk_state[bank][block].full == true
+						|| dev->blk_state[bank][block].area == DATA_BLOCK) 
+					block++;
+				dev->current_block_map[bank] = block;
+				dev->blk_state[bank][block].area = TR_BLOCK;
+			}
 
 			page = 0;
-			while (page_state[bank][block][page].write == true) {
+			while (dev->page_state[bank][block][page].write == true) {
 				page++;
 			}
 			
 
-			M_ppn = (N_PPNS_PB * bank) + (PAGES_PER_BLK * block) + page;	
-			GTD[bank][M_vpn] = M_ppn;
+			M_ppn = to_ppn(&dev->geo, bank, block, page);	
+			dev->GTD[bank][M_vpn & ~MAP_EXTENT_FLAG] = M_ppn;
+
+			nand_write(dev->nand, bank, block, page, valid_page, &M_vpn);
+			dev->bank_stats[bank].map_gc_write++;
 
-			nand_write(bank, block, page, valid_page, &M_vpn);
-			stats.map_gc_write++;
+			dev->page_state[bank][victim][j].valid = false;
 
-			page_state[bank][victim][j].valid = false;
+			dev->page_state[bank][block][page].write = true;
+			dev->page_state[bank][block][page].valid = true;
 
-			page_state[bank][block][page].write = true;
-			page_state[bank][block][page].valid = true;
+			dev->blk_state[bank][block].nvalid++;
 
-			blk_state[bank][block].nvalid++;
+			if (page == PAGES_PER_BLK - 1) {
+				dev->blk_state[bank][block].full = true;
+				dev->current_block_map[bank] = -1;
+			}
 		}
 	}
 
-	nand_erase(bank, victim);
-	blk_state[bank][victim].full = false;
-	blk_state[bank][victim].nvalid = 0;
-	blk_state[bank][victim].area = 0;
+	nand_erase(dev->nand, bank, victim);
+	dev->blk_state[bank][victim].full = false;
+	dev->blk_state[bank][victim].nvalid = 0;
+	dev->blk_state[bank][victim].area = 0;
 	
 	for (int i = 0 ; i < PAGES_PER_BLK ; i++) {
-		page_state[bank][victim][i].write = false;
-		page_state[bank][victim][i].valid = false;
+		dev->page_state[bank][victim][i].write = false;
+		dev->page_state[bank][victim][i].valid = false;
 	}
 
 	free(valid_page);
 
-	stats.map_gc_cnt++;
+	dev->bank_stats[bank].map_gc_cnt++;
+	split_update(dev, bank);
 	return;
 }
-static void garbage_collection(u32 bank)
+/*
+ *	Point the map of a relocated page at its new ppn, in the page's
+ *	home bank
+ */
+static void gc_update_map(struct ftl_device *dev, u32 lpn, u32 ppn)
+{
+	MAP_PAGE map_data;
+	bool compressed;
+	u32 home = lpn_bank(&dev->geo, lpn);
+	u32 map_page = lpn_map_page(&dev->geo, lpn);
+	u32 map_offset = lpn_map_offset(&dev->geo, lpn);
+
+	// Data ppn 바꾸기
+	u32 cmt_index = find_CMT(dev, home, map_page);
+
+	if (cmt_index != -1)
+	{
+		// CMT에 있을 때, CMT update
+		set_CMT(dev, home, cmt_index, map_offset, ppn);
+	}
+	else
+	{
+		// CMT에 없을 때, Map update and GTD update
+
+		// map garbage collection trigger
+		u32 nfull_tr = 0;
+		for (int j = 0 ; j < BLKS_PER_BANK ; j++) {
+			if (dev->blk_state[home][j].full == true 
+				&& dev->blk_state[home][j].area == TR_BLOCK)
+				nfull_tr++;
+		}
+
+
+		if (nfull_tr >= dev->split[home].map_blocks - N_GC_BLOCKS) {
+			map_garbage_collection(dev, home);
+		}
+
+		// get TR block
+		u32 M_ppn = dev->GTD[home][map_page];
+
+		// invalid old translate block, read map data
+		memset(&map_data, 0, PAGE_DATA_SIZE);
+		compressed = true;
+		if (M_ppn != -1)
+		{
+			u32 old_bank = ppn_bank(&dev->geo, M_ppn);
+			u32 old_block = ppn_block(&dev->geo, M_ppn);
+			u32 old_page = ppn_page(&dev->geo, M_ppn);
+
+			dev->page_state[old_bank][old_block][old_page].valid = false;
+			(dev->blk_state[old_bank][old_block].nvalid)--;
+
+			u32 M_spare;
+			nand_read(dev->nand, old_bank, old_block, old_page, &map_data, &M_spare);
+			dev->bank_stats[home].gc_read++;
+			compressed = (M_spare & MAP_EXTENT_FLAG) != 0;
+		}
+		update_map(&map_data, &compressed, map_offset, ppn);
+		
+		u32 M_block = 0;
+		u32 M_page = 0;
+
+		// find new map ppn
+		if (dev->current_block_map[home] == -1) {
+			M_block = 0;
+			while (dev->blk_state[home][M_block].full == true
+					|| dev->blk_state[home][M_block].area == DATA_BLOCK) 
+				M_block++;
+			dev->current_block_map[home] = M_block;
+		} else {
+			M_block = dev->current_block_map[home];
+		}
+		dev->blk_state[home][M_block].area = TR_BLOCK;
+		
+		M_page = 0;
+		while (dev->page_state[home][M_block][M_page].write == true) {
+			M_page++;
+		}
+		M_ppn = to_ppn(&dev->geo, home, M_block, M_page);
+
+		// write new translate block				
+		u32 M_vpn = map_page;
+		if (compressed)
+			M_vpn |= MAP_EXTENT_FLAG;
+		nand_write(dev->nand, home, M_block, M_page, &map_data, &M_vpn);
+		dev->bank_stats[home].gc_write++;
+
+		dev->page_state[home][M_block][M_page].write = true;
+		dev->page_state[home][M_block][M_page].valid = true;
+		(dev->blk_state[home][M_block].nvalid)++;
+
+		if (M_page == PAGES_PER_BLK - 1) {
+			dev->blk_state[home][M_block].full = true;
+			dev->current_block_map[home] = -1;
+		}
+
+		// GTD update
+		dev->GTD[home][map_page] = M_ppn;
+	}
+}
+
+/*
+ *	Charge the wall clock time since t0 to a bank's GC stats
+ */
+static void gc_time(struct ftl_device *dev, u32 bank, const struct timespec *t0, double share)
+{
+	struct timespec t1;
+	double t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	t = (t1.tv_sec - t0->tv_sec) + (t1.tv_nsec - t0->tv_nsec) / 1e9;
+	dev->bank_stats[bank].gc_time += t * share;
+	if (t > dev->bank_stats[bank].gc_time_max)
+		dev->bank_stats[bank].gc_time_max = t;
+}
+
+static void garbage_collection(struct ftl_device *dev, u32 bank)
 {
 	/* stats.gc_cnt++ every garbage_collection call*/
 	/* stats.gc_write++ every nand_write call*/
@@ -281,700 +1023,2114 @@ static void garbage_collection(u32 bank)
 	int victim = 0;
 	int min_nvalid = PAGES_PER_BLK + 1;
 	u32 *valid_page = malloc(PAGE_DATA_SIZE);
-	u32 *map_data = malloc(PAGE_DATA_SIZE);
 	u32 spare;
 	int page;
+	struct timespec t0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
 
 	int block = 0;
-	while (blk_state[bank][block].full == true 
-			|| blk_state[bank][block].area == TR_BLOCK) 
+	while (dev->blk_state[bank][block].full == true 
+			|| dev->blk_state[bank][block].area == TR_BLOCK) 
 	{
 		block++;
 	}
-	current_block_user[bank] = block;	
-	blk_state[bank][block].area = DATA_BLOCK;
+	dev->current_block_user[bank] = block;	
+	dev->blk_state[bank][block].area = DATA_BLOCK;
 
 
 	for (int j = 0 ; j < BLKS_PER_BANK ; j++) {
-		if (blk_state[bank][j].full == true && 
-		   (blk_state[bank][j].nvalid < min_nvalid) &&
-		   blk_state[bank][j].area == DATA_BLOCK) 
+		if (dev->blk_state[bank][j].full == true && 
+		   (dev->blk_state[bank][j].nvalid < min_nvalid) &&
+		   dev->blk_state[bank][j].area == DATA_BLOCK) 
 		{
-			min_nvalid = blk_state[bank][j].nvalid;
+			min_nvalid = dev->blk_state[bank][j].nvalid;
 			victim = j;
 		}
 	}
 
 	for (int j = 0 ; j < PAGES_PER_BLK ; j++) {
 
-		if (page_state[bank][victim][j].valid == true) {
-			nand_read(bank, victim, j, valid_page, &spare);
-			stats.gc_read ++;
+		if (dev->page_state[bank][victim][j].valid == true) {
+			nand_read(dev->nand, bank, victim, j, valid_page, &spare);
+			dev->bank_stats[bank].gc_read ++;
+
+			// destination filled up (it may start partly written), take another
+			if (dev->blk_state[bank][block].full == true) {
+				block = 0;
+				while (dev->blk_state[bank][block].full == true 
+						|| dev->blk_state[bank][block].area == TR_BLOCK) 
+					block++;
+				dev->current_block_user[bank] = block;
+				dev->blk_state[bank][block].area = DATA_BLOCK;
+			}
 
 			page = 0;
-			while (page_state[bank][block][page].write == true) {
+			while (dev->page_state[bank][block][page].write == true) {
 				page++;
 			}
-			u32 D_ppn = (N_PPNS_PB * bank) + (PAGES_PER_BLK * block) + page;	
+			u32 D_ppn = to_ppn(&dev->geo, bank, block, page);	
 			// PMT[spare] = ppn;
 
-			u32 map_page = spare / (N_BANKS * N_MAP_ENTRIES_PER_PAGE);
-			u32 map_offset = spare % (N_BANKS * N_MAP_ENTRIES_PER_PAGE) / (N_BANKS);
-
-			// Data ppn 바꾸기
-			u32 cmt_index = -1;
-			for (int j = 0; j < N_CACHED_MAP_PAGE_PB; j++) {
-				if (CMT[bank][j].map_page == map_page)
-					cmt_index = j;
-			}
-
-			if (cmt_index != -1)
-			{
-				// CMT에 있을 때, CMT update
-				CMT[bank][cmt_index].ref_time = ref_time;
-				CMT[bank][cmt_index].map_page = map_page;
-				CMT[bank][cmt_index].map_entry[map_offset] = D_ppn;
-				CMT[bank][cmt_index].valid = true;
-				CMT[bank][cmt_index].dirty = true;
-			}
-			else
-			{
-				// CMT에 없을 때, Map update and GTD update
-
-				// map garbage collection trigger
-				u32 nfull_tr = 0;
-				for (int j = 0 ; j < BLKS_PER_BANK ; j++) {
-					if (blk_state[bank][j].full == true 
-						&& blk_state[bank][j].area == TR_BLOCK)
-						nfull_tr++;
-				}
-
-
-				if (nfull_tr == N_MAP_BLOCKS_PB - N_GC_BLOCKS) {
-					map_garbage_collection(bank);
-				}
-
-				// get TR block
-				u32 M_ppn = GTD[bank][map_page];
-
-				// invalid old translate block, read map data
-				if (M_ppn != -1)
-				{
-					u32 old_bank = M_ppn / N_PPNS_PB;
-					u32 old_block = (M_ppn - (N_PPNS_PB * bank)) / PAGES_PER_BLK;
-					u32 old_page = (M_ppn - (N_PPNS_PB * bank)) % PAGES_PER_BLK;
-
-					page_state[old_bank][old_block][old_page].valid = false;
-					(blk_state[old_bank][old_block].nvalid)--;
+			gc_update_map(dev, spare, D_ppn);
 
-					u32 *idle;
-					nand_read(old_bank, old_block, old_page, map_data, &idle);
-					stats.gc_read++;
-
-					map_data[map_offset] = D_ppn;
-				}
-				
-				u32 M_block = 0;
-				u32 M_page = 0;
-
-				// find new map ppn
-				if (current_block_map[bank] == -1) {
-					M_block = 0;
-					while (blk_state[bank][M_block].full == true
-							|| blk_state[bank][M_block].area == DATA_BLOCK) 
-						M_block++;
-					current_block_map[bank] = M_block;
-				} else {
-					M_block = current_block_map[bank];
-				}
-				blk_state[bank][M_block].area = TR_BLOCK;
-				
-				M_page = 0;
-				while (page_state[bank][M_block][M_page].write == true) {
-					M_page++;
-				}
-				M_ppn = (N_PPNS_PB * bank) + (PAGES_PER_BLK * M_block) + M_page;
+			nand_write(dev->nand, bank, block, page, valid_page, &spare);
+			dev->bank_stats[bank].gc_write++;
 
-				// write new translate block				
-				u32 *M_vpn = &map_page;
-				nand_write(bank, M_block, M_page, map_data, M_vpn);
-				stats.gc_write++;
+			dev->page_state[bank][victim][j].valid = false;
 
-				page_state[bank][M_block][M_page].write = true;
-				page_state[bank][M_block][M_page].valid = true;
-				(blk_state[bank][M_block].nvalid)++;
+			dev->page_state[bank][block][page].write = true;
+			dev->page_state[bank][block][page].valid = true;
 
-				if (M_page == PAGES_PER_BLK - 1) {
-					blk_state[bank][M_block].full = true;
-					current_block_map[bank] = -1;
-				}
+			dev->blk_state[bank][block].nvalid++;
 
-				// GTD update
-				GTD[bank][map_page] = M_ppn;
+			if (page == PAGES_PER_BLK - 1) {
+				dev->blk_state[bank][block].full = true;
+				dev->current_block_user[bank] = -1;
 			}
-
-			nand_write(bank, block, page, valid_page, &spare);
-			stats.gc_write++;
-
-			page_state[bank][victim][j].valid = false;
-
-			page_state[bank][block][page].write = true;
-			page_state[bank][block][page].valid = true;
-
-			blk_state[bank][block].nvalid++;
 		}
 	}
 
-	nand_erase(bank, victim);
-	blk_state[bank][victim].full = false;
-	blk_state[bank][victim].nvalid = 0;
-	blk_state[bank][victim].area = 0;
+	nand_erase(dev->nand, bank, victim);
+	dev->blk_state[bank][victim].full = false;
+	dev->blk_state[bank][victim].nvalid = 0;
+	dev->blk_state[bank][victim].area = 0;
 	
 	for (int i = 0 ; i < PAGES_PER_BLK ; i++) {
-		page_state[bank][victim][i].write = false;
-		page_state[bank][victim][i].valid = false;
+		dev->page_state[bank][victim][i].write = false;
+		dev->page_state[bank][victim][i].valid = false;
 	}
 
 	free(valid_page);
-	free(map_data);
 
-	stats.gc_cnt++;
+	dev->bank_stats[bank].gc_cnt++;
+	gc_time(dev, bank, &t0, 1.);
+	split_update(dev, bank);
 	return;
 }
-void ftl_open()
+/*
+ *	Open a new stripe on an empty block of every bank
+ *
+ *	Returns false, with nothing changed, if every stripe is in use or a
+ *	bank has no empty block left.
+ */
+static bool sb_open(struct ftl_device *dev)
 {
-	nand_init(N_BANKS, BLKS_PER_BANK, PAGES_PER_BLK);
-
-	CMT = malloc(sizeof(CMT_t *) * N_BANKS);
-	for (int depth = 0; depth < N_BANKS; depth++)
-	{
-		CMT[depth] = malloc(sizeof(CMT_t) * N_CACHED_MAP_PAGE_PB);
-	}
-
-	for (int depth = 0; depth < N_BANKS; depth++)
-	{
-		for (int row = 0; row < N_CACHED_MAP_PAGE_PB; row++)
-		{
-			init_CMT(depth, row);
-		}
-
-		for (int map_page = 0; map_page < N_MAP_PAGES_PB; map_page++) 
-		{
-			GTD[depth][map_page] = -1;
+	int sb = 0;
+
+	while (sb < BLKS_PER_BANK && dev->sb[sb].block[0] != -1)
+		sb++;
+	if (sb == BLKS_PER_BANK)
+		return false;
+
+	for (int bank = 0; bank < N_BANKS; bank++) {
+		u32 block = 0;
+		while (block < BLKS_PER_BANK && dev->blk_state[bank][block].area != 0)
+			block++;
+		if (block == BLKS_PER_BANK) {
+			dev->sb[sb].block[0] = -1;
+			return false;
 		}
+		dev->sb[sb].block[bank] = block;
 	}
+	for (int bank = 0; bank < N_BANKS; bank++) {
+		dev->blk_state[bank][dev->sb[sb].block[bank]].area = DATA_BLOCK;
+		dev->blk_sb[bank][dev->sb[sb].block[bank]] = sb;
+	}
+	dev->sb[sb].nvalid = 0;
+	dev->sb[sb].full = false;
+	dev->sb_open = sb;
+	dev->sb_next = 0;
+	return true;
+}
 
-	buffer = malloc(sizeof(u32 *) * N_BUFFERS);
-	buffer_list = malloc(sizeof(u32) * N_BUFFERS);
-	buffer_count = malloc(sizeof(u32));
-	buffer_sector_valid = malloc(sizeof(bool *) * N_BUFFERS);
+/*
+ *	Next page of the open stripe, opening one if needed
+ */
+static u32 sb_alloc_page(struct ftl_device *dev)
+{
+	SUPERBLOCK *sb;
+	u32 bank, page;
 
-	for (int depth = 0; depth < N_BUFFERS; depth++) {
-		buffer[depth] = malloc(BUFFER_SIZE / N_BUFFERS);
-		buffer_sector_valid[depth] = malloc(sizeof(bool) * SECTORS_PER_PAGE);
+	// GC runs before the free blocks run out, so this is a broken invariant
+	if (dev->sb_open == -1 && !sb_open(dev)) {
+		fprintf(stderr, "ftl: no empty stripe left (%u full)\n", dev->sb_full);
+		abort();
 	}
 
-	for (int depth = 0; depth < N_BUFFERS; depth++)
-	{
-		for (int row = 0; row < SECTORS_PER_PAGE; row++)
-		{
-			buffer_sector_valid[depth][row] = false;
-		} 
-	}
+	sb = &dev->sb[dev->sb_open];
+	bank = dev->sb_next % N_BANKS;
+	page = dev->sb_next / N_BANKS;
 
-	for (int i = 0 ; i < N_BUFFERS ; i++) {
-		memset(buffer[i], -1, BUFFER_SIZE / N_BUFFERS);
-		buffer_list[i] = -1;
+	if (++dev->sb_next == N_BANKS * PAGES_PER_BLK) {
+		sb->full = true;
+		dev->sb_full++;
+		dev->sb_open = -1;
 	}
-	*buffer_count = 0;
+	return to_ppn(&dev->geo, bank, sb->block[bank], page);
+}
 
-	page_state = malloc(sizeof(PAGE_STATE **) * N_BANKS);
-	blk_state = malloc(sizeof(BLOCK_STATE *) * N_BANKS);
-	for (int depth = 0; depth < N_BANKS; depth++)
-	{
-		page_state[depth] = malloc(sizeof(PAGE_STATE *) * BLKS_PER_BANK);
-		blk_state[depth] = malloc(sizeof(BLOCK_STATE) * BLKS_PER_BANK);
+/*
+ *	Collect the full stripe with the fewest valid pages
+ *
+ *	Valid pages go to the open stripe, like host writes, and every block
+ *	of the victim is erased. gc_cnt counts erased blocks, as per-bank GC
+ *	does, and the GC time is split evenly over the banks.
+ */
+static void sb_garbage_collection(struct ftl_device *dev)
+{
+	int victim = -1;
+	u32 min_nvalid = -1;
+	u32 *valid_page = malloc(PAGE_DATA_SIZE);
+	u32 spare;
+	struct timespec t0;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	for (int sb = 0; sb < BLKS_PER_BANK; sb++) {
+		if (dev->sb[sb].full == true && dev->sb[sb].nvalid < min_nvalid) {
+			min_nvalid = dev->sb[sb].nvalid;
+			victim = sb;
+		}
+	}
+	if (victim == -1) {
+		free(valid_page);
+		return;
+	}
+
+	for (int bank = 0; bank < N_BANKS; bank++) {
+		u32 block = dev->sb[victim].block[bank];
+
+		for (int j = 0; j < PAGES_PER_BLK; j++) {
+			if (dev->page_state[bank][block][j].valid == false)
+				continue;
+
+			nand_read(dev->nand, bank, block, j, valid_page, &spare);
+			dev->bank_stats[bank].gc_read++;
+
+			u32 D_ppn = sb_alloc_page(dev);
+			u32 D_bank = ppn_bank(&dev->geo, D_ppn);
+			u32 D_block = ppn_block(&dev->geo, D_ppn);
+			u32 D_page = ppn_page(&dev->geo, D_ppn);
+
+			gc_update_map(dev, spare, D_ppn);
+
+			nand_write(dev->nand, D_bank, D_block, D_page, valid_page, &spare);
+			dev->bank_stats[D_bank].gc_write++;
+
+			dev->page_state[bank][block][j].valid = false;
+			dev->bank_valid[bank]--;
+
+			dev->page_state[D_bank][D_block][D_page].write = true;
+			dev->page_state[D_bank][D_block][D_page].valid = true;
+			dev->blk_state[D_bank][D_block].nvalid++;
+			dev->bank_valid[D_bank]++;
+			dev->sb[dev->blk_sb[D_bank][D_block]].nvalid++;
+			if (D_page == PAGES_PER_BLK - 1)
+				dev->blk_state[D_bank][D_block].full = true;
+		}
+	}
+
+	for (int bank = 0; bank < N_BANKS; bank++) {
+		u32 block = dev->sb[victim].block[bank];
+
+		nand_erase(dev->nand, bank, block);
+		dev->blk_state[bank][block].full = false;
+		dev->blk_state[bank][block].nvalid = 0;
+		dev->blk_state[bank][block].area = 0;
+		for (int i = 0; i < PAGES_PER_BLK; i++) {
+			dev->page_state[bank][block][i].write = false;
+			dev->page_state[bank][block][i].valid = false;
+		}
+		dev->blk_sb[bank][block] = -1;
+		dev->sb[victim].block[bank] = -1;
+		dev->bank_stats[bank].gc_cnt++;
+	}
+	dev->sb[victim].nvalid = 0;
+	dev->sb[victim].full = false;
+	dev->sb_full--;
+
+	for (int bank = 0; bank < N_BANKS; bank++)
+		gc_time(dev, bank, &t0, 1. / N_BANKS);
+
+	free(valid_page);
+}
+
+/*
+ *	Sectors of page lpn that the request lba, nsect covers
+ */
+static void page_range(u32 lba, u32 nsect, u32 lpn, u32 *offset, u32 *size)
+{
+	u32 first = lpn * SECTORS_PER_PAGE;
+	u32 start = lba > first ? lba : first;
+	u32 end = lba + nsect < first + SECTORS_PER_PAGE ? lba + nsect : first + SECTORS_PER_PAGE;
+
+	*offset = start - first;
+	*size = end - start;
+}
+
+static SECTOR_MASK sector_range(u32 offset, u32 size)
+{
+	return (SECTOR_MASK)(((1ull << size) - 1) << offset);
+}
+
+static const SECTOR_MASK sector_bit[32] = {
+	1u << 0, 1u << 1, 1u << 2, 1u << 3, 1u << 4, 1u << 5, 1u << 6, 1u << 7,
+	1u << 8, 1u << 9, 1u << 10, 1u << 11, 1u << 12, 1u << 13, 1u << 14, 1u << 15,
+	1u << 16, 1u << 17, 1u << 18, 1u << 19, 1u << 20, 1u << 21, 1u << 22, 1u << 23,
+	1u << 24, 1u << 25, 1u << 26, 1u << 27, 1u << 28, 1u << 29, 1u << 30, 1u << 31,
+};
+
+/*
+ *	dst[k] = src[k] for each of the first n sectors whose bit is set in mask
+ *
+ *	A select against a constant bit per sector rather than a branch or a
+ *	shift by k, so with n = SECTORS_PER_PAGE (whole pages) -O2 vectorizes
+ *	the loop. Ranges of a host buffer have a variable n and stay scalar.
+ */
+static inline void merge_sectors(u32 *restrict dst, const u32 *restrict src, SECTOR_MASK mask, u32 n)
+{
+	for (u32 k = 0; k < n; k++) {
+		u32 sel = -((mask & sector_bit[k]) != 0);
+		dst[k] = (src[k] & sel) | (dst[k] & ~sel);
+	}
+}
+
+/*
+ *	Run one page op on its bank
+ */
+static void exec_page_op(struct ftl_device *dev, PAGE_OP *op)
+{
+	u32 bank = lpn_bank(&dev->geo, op->lpn);
+	u32 data[SECTORS_PER_PAGE];
+
+	dev->bank_ref_time[bank] = op->ref_time;
+
+	if (op->type == PAGE_OP_READ) {
+		read_batch(dev, bank, op);
+	} else {
+		bool whole = op->valid == SECTOR_MASK_ALL;
+
+		// a partly buffered page is merged over the old one, read once here
+		if (!whole) {
+			memset(data, -1, PAGE_DATA_SIZE);
+			read(dev, op->lpn * SECTORS_PER_PAGE, SECTORS_PER_PAGE, data);
+			merge_sectors(data, op->data, op->valid, SECTORS_PER_PAGE);
+		}
+
+		write(dev, op->lpn * SECTORS_PER_PAGE, SECTORS_PER_PAGE, whole ? op->data : data);
+	}
+
+	if (op->pending)
+		__atomic_sub_fetch(op->pending, 1, __ATOMIC_SEQ_CST);
+	__atomic_sub_fetch(&dev->inflight, 1, __ATOMIC_SEQ_CST);
+	if (dev->n_workers)
+		__atomic_add_fetch(&dev->workers[bank % dev->n_workers].done, 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&dev->done_waiters, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&dev->done_lock);
+		pthread_cond_broadcast(&dev->done_cond);
+		pthread_mutex_unlock(&dev->done_lock);
+	}
+}
+
+static void *bank_worker(void *arg)
+{
+	FTL_WORKER *w = arg;
+	PAGE_OP op;
+	int idle = 0;
+
+	while (1) {
+		if (!ftl_ring_pop(&w->ring, &op)) {
+			if (++idle < WORKER_SPIN) {
+				sched_yield();
+				continue;
+			}
+
+			// sleep until the host pushes again
+			__atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+			if (ftl_ring_empty(&w->ring))
+				sem_wait(&w->wake);
+			__atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+			idle = 0;
+			continue;
+		}
+		idle = 0;
+
+		if (op.type == PAGE_OP_STOP)
+			break;
+		exec_page_op(w->dev, &op);
+	}
+	return NULL;
+}
+
+/*
+ *	Queue a page op on the worker of its bank, or run it right away
+ *	without workers
+ */
+static void submit_page_op(struct ftl_device *dev, PAGE_OP *op)
+{
+	FTL_WORKER *w;
+
+	if (op->pending)
+		__atomic_add_fetch(op->pending, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&dev->inflight, 1, __ATOMIC_RELAXED);
+
+	if (dev->n_workers == 0) {
+		exec_page_op(dev, op);
+		return;
+	}
+
+	w = &dev->workers[lpn_bank(&dev->geo, op->lpn) % dev->n_workers];
+	while (!ftl_ring_push(&w->ring, op))
+		sched_yield();
+	w->submitted++;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&w->sleeping, __ATOMIC_SEQ_CST)) {
+		__atomic_store_n(&w->sleeping, 0, __ATOMIC_SEQ_CST);
+		sem_post(&w->wake);
+	}
+}
+
+/*
+ *	Wait until ready(arg), checked again whenever a page op ends.
+ *	Spins for WORKER_SPIN checks, then sleeps on done_cond.
+ */
+static void wait_until(struct ftl_device *dev, bool (*ready)(void *), void *arg)
+{
+	for (int spin = 0; spin < WORKER_SPIN; spin++) {
+		if (ready(arg))
+			return;
+		sched_yield();
+	}
+
+	pthread_mutex_lock(&dev->done_lock);
+	__atomic_add_fetch(&dev->done_waiters, 1, __ATOMIC_SEQ_CST);
+	while (!ready(arg))
+		pthread_cond_wait(&dev->done_cond, &dev->done_lock);
+	__atomic_sub_fetch(&dev->done_waiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&dev->done_lock);
+}
+
+static bool no_pending(void *pending)
+{
+	return __atomic_load_n((int *)pending, __ATOMIC_SEQ_CST) == 0;
+}
+
+/*
+ *	Wait until a count of page ops reaches zero
+ */
+static void wait_page_ops(struct ftl_device *dev, int *pending)
+{
+	wait_until(dev, no_pending, pending);
+}
+
+typedef struct OPS_MARK{
+	struct ftl_device *dev;
+	unsigned long *mark;			// per worker, ops submitted at the mark
+}OPS_MARK;
+
+static bool ops_done_to_mark(void *arg)
+{
+	OPS_MARK *m = arg;
+
+	for (int i = 0; i < m->dev->n_workers; i++) {
+		if (__atomic_load_n(&m->dev->workers[i].done, __ATOMIC_SEQ_CST) < m->mark[i])
+			return false;
+	}
+	return true;
+}
+
+/*
+ *	Wait until every page op submitted so far is done
+ *
+ *	Called with host_lock held. The lock is dropped for the wait, so
+ *	other threads keep starting commands, and their ops are not waited
+ *	for: a worker runs its ops in order, so it is enough that each one
+ *	gets past the count it had been given. mark has n_workers entries.
+ */
+static void wait_queued_ops(struct ftl_device *dev, unsigned long *mark)
+{
+	OPS_MARK m = { .dev = dev, .mark = mark };
+
+	// without workers every op ran when it was submitted
+	if (dev->n_workers == 0)
+		return;
+
+	for (int i = 0; i < dev->n_workers; i++)
+		mark[i] = dev->workers[i].submitted;
+	pthread_mutex_unlock(&dev->host_lock);
+	wait_until(dev, ops_done_to_mark, &m);
+	pthread_mutex_lock(&dev->host_lock);
+}
+
+static void start_workers(struct ftl_device *dev)
+{
+	dev->n_workers = dev->geo.n_workers < N_BANKS ? dev->geo.n_workers : N_BANKS;
+	// a page op may write to and GC any bank, so one worker owns them all:
+	// with SUPERBLOCK the data page goes to the open stripe's next bank,
+	// the old copy and the map stay wherever they are, and stripe GC
+	// moves pages between all banks
+	if ((dev->geo.write_bank != FTL_WRITE_BANK_HOME || dev->geo.superblock) && dev->n_workers > 1)
+		dev->n_workers = 1;
+	if (dev->n_workers == 0)
+		return;
+
+	dev->workers = calloc(dev->n_workers, sizeof(FTL_WORKER));
+	for (int i = 0; i < dev->n_workers; i++) {
+		FTL_WORKER *w = &dev->workers[i];
+		w->dev = dev;
+		ftl_ring_init(&w->ring, WORKER_RING_SIZE, sizeof(PAGE_OP));
+		sem_init(&w->wake, 0, 0);
+		pthread_create(&w->thread, NULL, bank_worker, w);
+	}
+}
+
+static void stop_workers(struct ftl_device *dev)
+{
+	PAGE_OP op = { .type = PAGE_OP_STOP };
+
+	for (int i = 0; i < dev->n_workers; i++) {
+		FTL_WORKER *w = &dev->workers[i];
+		while (!ftl_ring_push(&w->ring, &op))
+			sched_yield();
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		sem_post(&w->wake);
+	}
+	for (int i = 0; i < dev->n_workers; i++) {
+		pthread_join(dev->workers[i].thread, NULL);
+		ftl_ring_free(&dev->workers[i].ring);
+		sem_destroy(&dev->workers[i].wake);
+	}
+	free(dev->workers);
+	dev->n_workers = 0;
+}
+
+/*
+ * open an FTL instance with its own NAND
+ * @dev_: set to the new instance
+ * @geo: device geometry, copied into the instance
+ *
+ * Returns:
+ *   0 on success
+ *   FTL_ERR_INVALID if the geometry can not run the FTL
+ */
+int ftl_open(struct ftl_device **dev_, const struct ftl_geometry *geo)
+{
+	struct ftl_device *dev = calloc(1, sizeof(struct ftl_device));
+
+	dev->geo = *geo;
+	if (ftl_check_geometry(&dev->geo) != FTL_SUCCESS ||
+		nand_init(&dev->nand, N_BANKS, BLKS_PER_BANK, PAGES_PER_BLK) != NAND_SUCCESS) {
+		free(dev);
+		return FTL_ERR_INVALID;
+	}
+	nand_set_timing(dev->nand, dev->geo.t_read * 1000, dev->geo.t_prog * 1000, dev->geo.t_erase * 1000, dev->geo.t_xfer * 1000);
+	nand_set_channels(dev->nand, dev->geo.n_channels);
+	dram_init(dev);
+
+	dev->CMT = malloc(sizeof(CMT_t *) * N_BANKS);
+	dev->CMT_used = malloc(sizeof(u32) * N_BANKS);
+	dev->GTD = malloc(sizeof(u32 *) * N_BANKS);
+	for (int depth = 0; depth < N_BANKS; depth++)
+	{
+		dev->CMT[depth] = calloc(dev->n_cmt_slots, sizeof(CMT_t));
+		dev->CMT_used[depth] = 0;
+		dev->GTD[depth] = malloc(sizeof(u32) * N_MAP_PAGES_PB);
+	}
+
+	for (int depth = 0; depth < N_BANKS; depth++)
+	{
+		for (int row = 0; row < dev->n_cmt_slots; row++)
+		{
+			init_CMT(dev, depth, row);
+		}
+
+		for (int map_page = 0; map_page < N_MAP_PAGES_PB; map_page++) 
+		{
+			dev->GTD[depth][map_page] = -1;
+		}
+	}
+
+	dev->prefetch_state = malloc(sizeof(PREFETCH_STATE) * N_BANKS);
+	for (int depth = 0; depth < N_BANKS; depth++) {
+		dev->prefetch_state[depth].last_map_page = -1;
+		dev->prefetch_state[depth].stride = 0;
+		dev->prefetch_state[depth].run = 0;
+	}
+
+	dev->buffer = malloc(sizeof(u32 *) * dev->buffer_slots);
+	dev->buffer_list = malloc(sizeof(u32) * dev->buffer_slots);
+	dev->buffer_valid = calloc(dev->buffer_slots, sizeof(SECTOR_MASK));
+
+	for (int depth = 0; depth < dev->buffer_slots; depth++)
+		dev->buffer[depth] = malloc(PAGE_DATA_SIZE);
+
+	for (int i = 0 ; i < dev->buffer_slots ; i++) {
+		memset(dev->buffer[i], -1, PAGE_DATA_SIZE);
+		dev->buffer_list[i] = -1;
+	}
+	dev->buffer_count = 0;
+
+	lpn_index_init(&dev->buffer_index, dev->buffer_slots);
+	dev->buffer_prev = malloc(sizeof(int) * dev->buffer_slots);
+	dev->buffer_next = malloc(sizeof(int) * dev->buffer_slots);
+	for (int i = 0; i < dev->buffer_slots; i++)
+		dev->buffer_next[i] = i + 1 < dev->buffer_slots ? i + 1 : -1;
+	dev->buffer_order = (SLOT_LIST){ .first = -1, .last = -1 };
+	dev->buffer_free = 0;
+	rcache_init(&dev->rcache, dev->geo.read_cache, dev->geo.adaptive_dram ? dev->dram_pages : dev->geo.read_cache);
+	ghost_init(&dev->rcache.dropped, dev->geo.adaptive_dram ? dev->dram_step : 0);
+	if (dev->geo.adaptive_dram)
+		dram_record(dev);
+	dev->flush_batch = malloc(sizeof(BATCH_ENTRY) * dev->geo.flush_batch);
+	dev->flush_taken = malloc(sizeof(int) * N_BANKS);
+	dev->flush_map_page = malloc(sizeof(u32) * N_BANKS);
+
+	dev->page_state = malloc(sizeof(PAGE_STATE **) * N_BANKS);
+	dev->blk_state = malloc(sizeof(BLOCK_STATE *) * N_BANKS);
+	dev->current_block_map = malloc(sizeof(u32) * N_BANKS);
+	dev->current_block_user = malloc(sizeof(u32) * N_BANKS);
+	for (int depth = 0; depth < N_BANKS; depth++)
+	{
+		dev->page_state[depth] = malloc(sizeof(PAGE_STATE *) * BLKS_PER_BANK);
+		dev->blk_state[depth] = malloc(sizeof(BLOCK_STATE) * BLKS_PER_BANK);
 		for (int row = 0; row < BLKS_PER_BANK; row++)
 		{
-			page_state[depth][row] = malloc(sizeof(PAGE_STATE) * PAGES_PER_BLK);
+			dev->page_state[depth][row] = malloc(sizeof(PAGE_STATE) * PAGES_PER_BLK);
 		}
 	}
 
 	for (int depth = 0; depth < N_BANKS; depth++)
 	{
-		current_block_map[depth] = -1;
-		current_block_user[depth] = -1;
+		dev->current_block_map[depth] = -1;
+		dev->current_block_user[depth] = -1;
 		for (int row = 0; row < BLKS_PER_BANK; row++)
 		{
 			for (int column = 0; column < PAGES_PER_BLK; column++)
 			{
-				page_state[depth][row][column].write = false;
-				page_state[depth][row][column].valid = false;
+				dev->page_state[depth][row][column].write = false;
+				dev->page_state[depth][row][column].valid = false;
 			}
-			blk_state[depth][row].nvalid = 0;
-			blk_state[depth][row].full = false;
-			blk_state[depth][row].area = 0;
+			dev->blk_state[depth][row].nvalid = 0;
+			dev->blk_state[depth][row].full = false;
+			dev->blk_state[depth][row].area = 0;
 		} 
 	}
+
+	dev->bank_valid = calloc(N_BANKS, sizeof(u32));
+
+	if (dev->geo.superblock) {
+		dev->sb = malloc(sizeof(SUPERBLOCK) * BLKS_PER_BANK);
+		for (int sb = 0; sb < BLKS_PER_BANK; sb++) {
+			dev->sb[sb].block = malloc(sizeof(u32) * N_BANKS);
+			memset(dev->sb[sb].block, -1, sizeof(u32) * N_BANKS);
+			dev->sb[sb].nvalid = 0;
+			dev->sb[sb].full = false;
+		}
+		dev->blk_sb = malloc(sizeof(int *) * N_BANKS);
+		for (int bank = 0; bank < N_BANKS; bank++) {
+			dev->blk_sb[bank] = malloc(sizeof(int) * BLKS_PER_BANK);
+			memset(dev->blk_sb[bank], -1, sizeof(int) * BLKS_PER_BANK);
+		}
+	}
+	dev->sb_open = -1;
+
+	dev->split = calloc(N_BANKS, sizeof(BANK_SPLIT));
+
+	dev->bank_stats = calloc(N_BANKS, sizeof(struct ftl_stats));
+	dev->bank_ref_time = calloc(N_BANKS, sizeof(u32));
+	for (int bank = 0; bank < N_BANKS; bank++)
+		split_init(dev, bank);
+	pthread_mutex_init(&dev->host_lock, NULL);
+	pthread_mutex_init(&dev->done_lock, NULL);
+	pthread_cond_init(&dev->done_cond, NULL);
+	start_workers(dev);
+
+	*dev_ = dev;
+	return FTL_SUCCESS;
 }
 
-void ftl_read(u32 lba, u32 nsect, u32 *read_buffer)
-{	
-	int bank;
-	int D_bank;
-	int D_block;
-	int D_page;
-	int M_bank;
-	int M_block;
-	int M_page;
-	u32 offset;
+/*
+ * free an FTL instance and its NAND
+ */
+void ftl_close(struct ftl_device *dev)
+{
+	wait_page_ops(dev, &dev->inflight);
+	stop_workers(dev);
+
+	for (int depth = 0; depth < N_BANKS; depth++) {
+		for (int row = 0; row < BLKS_PER_BANK; row++)
+			free(dev->page_state[depth][row]);
+		free(dev->page_state[depth]);
+		free(dev->blk_state[depth]);
+		free(dev->CMT[depth]);
+		free(dev->GTD[depth]);
+	}
+	free(dev->page_state);
+	free(dev->blk_state);
+	free(dev->current_block_map);
+	free(dev->current_block_user);
+	free(dev->bank_valid);
+	if (dev->geo.superblock) {
+		for (int sb = 0; sb < BLKS_PER_BANK; sb++)
+			free(dev->sb[sb].block);
+		for (int bank = 0; bank < N_BANKS; bank++)
+			free(dev->blk_sb[bank]);
+		free(dev->sb);
+		free(dev->blk_sb);
+	}
+	for (int bank = 0; bank < N_BANKS; bank++)
+		free(dev->split[bank].history);
+	free(dev->split);
+	free(dev->CMT);
+	free(dev->CMT_used);
+	free(dev->GTD);
+	free(dev->prefetch_state);
+
+	for (int depth = 0; depth < dev->buffer_slots; depth++)
+		free(dev->buffer[depth]);
+	free(dev->buffer);
+	free(dev->buffer_list);
+	free(dev->buffer_valid);
+	free(dev->buffer_index.entry);
+	free(dev->buffer_prev);
+	free(dev->buffer_next);
+	free(dev->flush_batch);
+	free(dev->flush_taken);
+	free(dev->flush_map_page);
+	rcache_free(&dev->rcache);
+	ghost_free(&dev->buffer_ghost);
+	for (int bank = 0; bank < N_BANKS; bank++)
+		ghost_free(&dev->cmt_ghost[bank]);
+	free(dev->cmt_ghost);
+	free(dev->dram_history);
+
+	free(dev->bank_stats);
+	free(dev->bank_ref_time);
+	pthread_mutex_destroy(&dev->host_lock);
+	pthread_mutex_destroy(&dev->done_lock);
+	pthread_cond_destroy(&dev->done_cond);
+
+	nand_close(dev->nand);
+	free(dev);
+}
+
+const struct ftl_geometry *ftl_get_geometry(const struct ftl_device *dev)
+{
+	return &dev->geo;
+}
+
+/*
+ * stats of the host side and all banks, waits for queued page ops
+ *
+ * Reads still outstanding on a queue pair are not counted yet.
+ */
+const struct ftl_stats *ftl_get_stats(struct ftl_device *dev)
+{
+	struct ftl_stats *s = &dev->stats;
+
+	pthread_mutex_lock(&dev->host_lock);
+	wait_page_ops(dev, &dev->inflight);
+
+	*s = dev->host_stats;
+
+	for (int bank = 0; bank < N_BANKS; bank++) {
+		struct ftl_stats *b = &dev->bank_stats[bank];
+		s->gc_cnt += b->gc_cnt;
+		s->map_gc_cnt += b->map_gc_cnt;
+		s->host_read += b->host_read;
+		s->nand_write += b->nand_write;
+		s->nand_read += b->nand_read;
+		s->gc_write += b->gc_write;
+		s->gc_read += b->gc_read;
+		s->map_write += b->map_write;
+		s->map_read += b->map_read;
+		s->map_gc_write += b->map_gc_write;
+		s->map_gc_read += b->map_gc_read;
+		s->cache_hit += b->cache_hit;
+		s->cache_miss += b->cache_miss;
+		s->prefetch_read += b->prefetch_read;
+		s->prefetch_hit += b->prefetch_hit;
+		s->prefetch_waste += b->prefetch_waste;
+		if (b->cmt_max_cached > s->cmt_max_cached)
+			s->cmt_max_cached = b->cmt_max_cached;
+		s->gc_time += b->gc_time;
+		if (b->gc_time_max > s->gc_time_max)
+			s->gc_time_max = b->gc_time_max;
+	}
+
+	long max_ops = 0;
+	for (int bank = 0; bank < N_BANKS; bank++) {
+		struct ftl_stats *b = &dev->bank_stats[bank];
+		long ops = b->nand_read + b->nand_write + b->gc_read + b->gc_write +
+				   b->map_read + b->map_write + b->map_gc_read + b->map_gc_write;
+		if (ops > max_ops)
+			max_ops = ops;
+	}
+	long total_ops = s->nand_read + s->nand_write + s->gc_read + s->gc_write +
+					 s->map_read + s->map_write + s->map_gc_read + s->map_gc_write;
+	s->bank_imbalance = total_ops ? (double)max_ops * N_BANKS / total_ops : 1.;
+	pthread_mutex_unlock(&dev->host_lock);
+	return s;
+}
+
+static void lpn_index_init(LPN_INDEX *idx, int n)
+{
 	u32 size;
-	u32 D_ppn = 0;
-	u32 M_ppn = 0;
-	u32 *read_data = malloc(PAGE_DATA_SIZE);
-	int *lpn = malloc(sizeof(int));
-	int buffer_i = -1;
-	bool incomplete = false;
 
-	
-	int end_page = (lba + nsect) / SECTORS_PER_PAGE;
-	if ((lba + nsect) % SECTORS_PER_PAGE != 0)
-		end_page++;
+	for (size = 1; size < 2 * n; size *= 2)
+		;
+	idx->entry = malloc(sizeof(LPN_SLOT) * size);
+	for (u32 i = 0; i < size; i++)
+		idx->entry[i].lpn = -1;
+	idx->mask = size - 1;
+}
 
-	int start_page = lba / SECTORS_PER_PAGE;
-	int npage = end_page - start_page;
+static u32 lpn_hash(const LPN_INDEX *idx, u32 lpn)
+{
+	return (lpn * 2654435761u) & idx->mask;
+}
 
-	for (int i = 0 ; i < npage; i++) {
-		
-		memset(read_data, -1, SECTOR_SIZE * SECTORS_PER_PAGE);
+/*
+ *	Slot of lpn, -1 if it is not in the index
+ */
+static int lpn_index_find(const LPN_INDEX *idx, u32 lpn)
+{
+	for (u32 h = lpn_hash(idx, lpn); idx->entry[h].lpn != -1; h = (h + 1) & idx->mask) {
+		if (idx->entry[h].lpn == lpn)
+			return idx->entry[h].slot;
+	}
+	return -1;
+}
 
-		*lpn = (lba / SECTORS_PER_PAGE) + i;
-		bank = *lpn % N_BANKS;
+static void lpn_index_add(LPN_INDEX *idx, u32 lpn, int slot)
+{
+	u32 h = lpn_hash(idx, lpn);
 
-		incomplete = false;
-		buffer_i = -1;
+	while (idx->entry[h].lpn != -1)
+		h = (h + 1) & idx->mask;
+	idx->entry[h] = (LPN_SLOT){ .lpn = lpn, .slot = slot };
+}
 
-		// buffer에 있는지 확인 
-		for (int j = 0 ; j < *buffer_count ; j++) {
-			if (buffer_list[j] == *lpn) {
-				buffer_i = j;
-				if (i == 0) {
-					offset = lba % SECTORS_PER_PAGE;
-					if (offset + nsect < SECTORS_PER_PAGE)
-						size = nsect * SECTOR_SIZE;
-					else
-						size = PAGE_DATA_SIZE - offset * SECTOR_SIZE;
-					for (int k = offset ; k < offset + size / SECTOR_SIZE ; k++) {
-						if (buffer_sector_valid[j][k] == false) {
-							incomplete = true;
-							break;
-						}
-					}
-					if (!incomplete) {
-						memcpy(read_buffer, buffer[j] + offset, size);
-						// read_buffer += SECTORS_PER_PAGE - offset;
-						read_buffer += size / SECTOR_SIZE;
-					}
-				} else if (i == npage - 1) {
-					offset = (lba + nsect) % SECTORS_PER_PAGE;
-					if (offset == 0)
-						size = PAGE_DATA_SIZE;
-					else
-						size = offset * SECTOR_SIZE;
-
-					for (int k = 0 ; k < size / SECTOR_SIZE ; k++) {
-						if (buffer_sector_valid[j][k] == false) {
-							incomplete = true;
-							break;
-						}
-					}
-					if (!incomplete) {
-						memcpy(read_buffer, buffer[j], size);
-						read_buffer += size / SECTOR_SIZE;
-						// read_buffer -= nsect;
-					}
-				} else {
-					size = PAGE_DATA_SIZE;
-
-					for (int k = 0 ; k < size / SECTOR_SIZE ; k++) {
-						if (buffer_sector_valid[j][k] == false) {
-							incomplete = true;
-							break;
-						}
-					}
-					if (!incomplete) {
-						memcpy(read_buffer, buffer[j], size);
-						read_buffer += SECTORS_PER_PAGE;
-					}
-				}
-				break;
-			}
-		}
+/*
+ *	Remove lpn, moving later entries of its probe run back into the hole
+ */
+static void lpn_index_remove(LPN_INDEX *idx, u32 lpn)
+{
+	u32 mask = idx->mask;
+	u32 h = lpn_hash(idx, lpn);
 
-		if (!incomplete && buffer_i != -1) {
-			continue;
+	while (idx->entry[h].lpn != lpn) {
+		if (idx->entry[h].lpn == -1)
+			return;
+		h = (h + 1) & mask;
+	}
+	for (u32 next = (h + 1) & mask; idx->entry[next].lpn != -1; next = (next + 1) & mask) {
+		u32 home = lpn_hash(idx, idx->entry[next].lpn);
+		// the entry may fill the hole only if its home is not in (h, next]
+		if (((next - home) & mask) >= ((next - h) & mask)) {
+			idx->entry[h] = idx->entry[next];
+			h = next;
 		}
-			
+	}
+	idx->entry[h].lpn = -1;
+}
 
-		read(*lpn * SECTORS_PER_PAGE, SECTORS_PER_PAGE, read_data);
-
-		if (i == 0) {
-			offset = lba % SECTORS_PER_PAGE;
-			if (offset + nsect < SECTORS_PER_PAGE)
-				size = nsect * SECTOR_SIZE;
-			else
-				size = PAGE_DATA_SIZE - offset * SECTOR_SIZE;
-			memcpy(read_buffer, read_data + offset, size);
-			if (incomplete == true) {
-				for (int j = offset ; j < offset + size / SECTOR_SIZE ; j++) {
-					if (buffer_sector_valid[buffer_i][j] == true) {
-						read_buffer[j] = buffer[buffer_i][j];
-					}
-				}
-			}
-			// read_buffer += SECTORS_PER_PAGE - offset;
-			read_buffer += size / SECTOR_SIZE;
-		} else if (i == npage - 1) {
-			offset = (lba + nsect) % SECTORS_PER_PAGE;
-			if (offset == 0)
-				size = PAGE_DATA_SIZE;
-			else
-				size = offset * SECTOR_SIZE;
-			memcpy(read_buffer, read_data, size);
-			if (incomplete == true) {
-				for (int j = 0 ; j < size / SECTOR_SIZE ; j++) {
-					if (buffer_sector_valid[buffer_i][j] == true) {
-						read_buffer[j] = buffer[buffer_i][j];
-					}
-				}
-			}
-			read_buffer += size / SECTOR_SIZE;
-		} else {
-			size = PAGE_DATA_SIZE;
-			memcpy(read_buffer, read_data, size);
-			if (incomplete == true) {
-				for (int j = 0 ; j < size / SECTOR_SIZE ; j++) {
-					if (buffer_sector_valid[buffer_i][j] == true) {
-						read_buffer[j] = buffer[buffer_i][j];
-					}
-				}
-			}
-			read_buffer += SECTORS_PER_PAGE;
+static void slot_list_unlink(SLOT_LIST *l, int *prev, int *next, int slot)
+{
+	if (prev[slot] != -1)
+		next[prev[slot]] = next[slot];
+	else
+		l->first = next[slot];
+	if (next[slot] != -1)
+		prev[next[slot]] = prev[slot];
+	else
+		l->last = prev[slot];
+	l->n--;
+}
+
+static void slot_list_append(SLOT_LIST *l, int *prev, int *next, int slot)
+{
+	prev[slot] = l->last;
+	next[slot] = -1;
+	if (l->last != -1)
+		next[l->last] = slot;
+	else
+		l->first = slot;
+	l->last = slot;
+	l->n++;
+}
+
+static void ghost_init(GHOST_LIST *g, int size)
+{
+	memset(g, 0, sizeof(*g));
+	g->size = size;
+	if (size == 0)
+		return;
+	g->key = malloc(sizeof(u32) * size);
+	memset(g->key, -1, sizeof(u32) * size);
+	lpn_index_init(&g->index, size);
+}
+
+static void ghost_free(GHOST_LIST *g)
+{
+	free(g->key);
+	free(g->index.entry);
+}
+
+/*
+ *	Remember a dropped key, forgetting the oldest one if full
+ */
+static void ghost_add(GHOST_LIST *g, u32 key)
+{
+	int pos;
+
+	if (g->size == 0)
+		return;
+	if ((pos = lpn_index_find(&g->index, key)) != -1) {
+		g->key[pos] = -1;
+		lpn_index_remove(&g->index, key);
+	}
+
+	if (g->n == g->size) {
+		pos = g->head;
+		if (g->key[pos] != -1)
+			lpn_index_remove(&g->index, g->key[pos]);
+		g->head = (g->head + 1) % g->size;
+	} else {
+		pos = (g->head + g->n++) % g->size;
+	}
+	g->key[pos] = key;
+	lpn_index_add(&g->index, key, pos);
+}
+
+/*
+ *	Count a miss on key if it is a ghost, and take the ghost back
+ */
+static void ghost_hit(GHOST_LIST *g, u32 key)
+{
+	int pos;
+
+	if (g->size == 0 || (pos = lpn_index_find(&g->index, key)) == -1)
+		return;
+	g->key[pos] = -1;
+	lpn_index_remove(&g->index, key);
+	g->hits++;
+}
+
+/*
+ *	Write buffer slot holding lpn, -1 if it is not buffered
+ */
+static int buffer_find(struct ftl_device *dev, u32 lpn)
+{
+	return lpn_index_find(&dev->buffer_index, lpn);
+}
+
+static void buffer_unlink(struct ftl_device *dev, int slot)
+{
+	slot_list_unlink(&dev->buffer_order, dev->buffer_prev, dev->buffer_next, slot);
+}
+
+/*
+ *	Put a slot last in eviction order
+ */
+static void buffer_append(struct ftl_device *dev, int slot)
+{
+	slot_list_append(&dev->buffer_order, dev->buffer_prev, dev->buffer_next, slot);
+}
+
+static void rcache_init(READ_CACHE *rc, int size, int capacity)
+{
+	int n;
+
+	memset(rc, 0, sizeof(*rc));
+	rc->size = size;
+	rc->capacity = capacity;
+	rc->kin = size / 4 > 0 ? size / 4 : 1;
+	rc->kout = size / 2 > 0 ? size / 2 : 1;
+	if (capacity == 0)
+		return;
+
+	// every page may be cached while kout ghosts are kept
+	n = capacity + (capacity / 2 > 0 ? capacity / 2 : 1);
+	rc->data = malloc(PAGE_DATA_SIZE * n);
+	rc->lpn = malloc(sizeof(u32) * n);
+	rc->queue = malloc(sizeof(int) * n);
+	rc->prev = malloc(sizeof(int) * n);
+	rc->next = malloc(sizeof(int) * n);
+	for (int i = 0; i < n; i++)
+		rc->next[i] = i + 1 < n ? i + 1 : -1;
+	for (int q = RC_A1IN; q <= RC_A1OUT; q++)
+		rc->q[q] = (SLOT_LIST){ .first = -1, .last = -1 };
+	rc->free = 0;
+	lpn_index_init(&rc->index, n);
+}
+
+static void rcache_free(READ_CACHE *rc)
+{
+	ghost_free(&rc->dropped);
+	if (rc->capacity == 0)
+		return;
+	free(rc->data);
+	free(rc->lpn);
+	free(rc->queue);
+	free(rc->prev);
+	free(rc->next);
+	free(rc->index.entry);
+}
+
+static void rcache_move(READ_CACHE *rc, int slot, int queue)
+{
+	slot_list_unlink(&rc->q[rc->queue[slot]], rc->prev, rc->next, slot);
+	slot_list_append(&rc->q[queue], rc->prev, rc->next, slot);
+	rc->queue[slot] = queue;
+}
+
+static void rcache_drop(READ_CACHE *rc, int slot)
+{
+	slot_list_unlink(&rc->q[rc->queue[slot]], rc->prev, rc->next, slot);
+	lpn_index_remove(&rc->index, rc->lpn[slot]);
+	rc->next[slot] = rc->free;
+	rc->free = slot;
+}
+
+/*
+ *	Cached copy of lpn, NULL on a miss
+ */
+static const u32 *rcache_lookup(READ_CACHE *rc, u32 lpn)
+{
+	int slot;
+
+	if (rc->size == 0 || (slot = lpn_index_find(&rc->index, lpn)) == -1 || rc->queue[slot] == RC_A1OUT)
+		return NULL;
+	if (rc->queue[slot] == RC_AM)
+		rcache_move(rc, slot, RC_AM);
+	return rc->data + (size_t)slot * SECTORS_PER_PAGE;
+}
+
+/*
+ *	Free a page's worth of room, from a1in while it is over kin
+ */
+static void rcache_reclaim(READ_CACHE *rc)
+{
+	int victim;
+
+	if (rc->q[RC_A1IN].n > rc->kin || rc->q[RC_AM].n == 0) {
+		victim = rc->q[RC_A1IN].first;
+		ghost_add(&rc->dropped, rc->lpn[victim]);
+		rcache_move(rc, victim, RC_A1OUT);
+		if (rc->q[RC_A1OUT].n > rc->kout)
+			rcache_drop(rc, rc->q[RC_A1OUT].first);
+	} else {
+		victim = rc->q[RC_AM].first;
+		ghost_add(&rc->dropped, rc->lpn[victim]);
+		rcache_drop(rc, victim);
+	}
+}
+
+/*
+ *	Change the number of pages with data, see dram_update
+ */
+static void rcache_resize(READ_CACHE *rc, int size)
+{
+	rc->size = size;
+	rc->kin = size / 4 > 0 ? size / 4 : 1;
+	rc->kout = size / 2 > 0 ? size / 2 : 1;
+	while (rc->q[RC_A1IN].n + rc->q[RC_AM].n > size)
+		rcache_reclaim(rc);
+	while (rc->q[RC_A1OUT].n > rc->kout)
+		rcache_drop(rc, rc->q[RC_A1OUT].first);
+}
+
+/*
+ *	Cache a page just read from flash
+ */
+static void rcache_insert(READ_CACHE *rc, u32 lpn, const u32 *page)
+{
+	int slot;
+
+	if (rc->size == 0) {
+		// dropped as soon as it came
+		ghost_add(&rc->dropped, lpn);
+		return;
+	}
+
+	slot = lpn_index_find(&rc->index, lpn);
+	if (slot != -1 && rc->queue[slot] != RC_A1OUT) {
+		memcpy(rc->data + (size_t)slot * SECTORS_PER_PAGE, page, PAGE_DATA_SIZE);
+		return;
+	}
+
+	if (slot != -1) {
+		// seen again while a ghost
+		slot_list_unlink(&rc->q[RC_A1OUT], rc->prev, rc->next, slot);
+		if (rc->q[RC_A1IN].n + rc->q[RC_AM].n == rc->size)
+			rcache_reclaim(rc);
+		slot_list_append(&rc->q[RC_AM], rc->prev, rc->next, slot);
+		rc->queue[slot] = RC_AM;
+	} else {
+		if (rc->q[RC_A1IN].n + rc->q[RC_AM].n == rc->size)
+			rcache_reclaim(rc);
+		slot = rc->free;
+		rc->free = rc->next[slot];
+		rc->lpn[slot] = lpn;
+		lpn_index_add(&rc->index, lpn, slot);
+		slot_list_append(&rc->q[RC_A1IN], rc->prev, rc->next, slot);
+		rc->queue[slot] = RC_A1IN;
+	}
+	memcpy(rc->data + (size_t)slot * SECTORS_PER_PAGE, page, PAGE_DATA_SIZE);
+}
+
+/*
+ *	Apply written sectors to a cached page
+ */
+static void rcache_update(READ_CACHE *rc, u32 lpn, const u32 *page, SECTOR_MASK mask)
+{
+	int slot;
+
+	if (rc->size == 0 || (slot = lpn_index_find(&rc->index, lpn)) == -1 || rc->queue[slot] == RC_A1OUT)
+		return;
+	merge_sectors(rc->data + (size_t)slot * SECTORS_PER_PAGE, page, mask, SECTORS_PER_PAGE);
+}
+
+/*
+ *	Free a write buffer slot, dropping what it holds
+ */
+static void buffer_release(struct ftl_device *dev, int slot)
+{
+	lpn_index_remove(&dev->buffer_index, dev->buffer_list[slot]);
+	buffer_unlink(dev, slot);
+	dev->buffer_valid[slot] = 0;
+	dev->buffer_list[slot] = -1;
+	dev->buffer_next[slot] = dev->buffer_free;
+	dev->buffer_free = slot;
+	dev->buffer_count--;
+}
+
+/*
+ *	Flush a buffered page to its bank and free its slot
+ */
+static void buffer_flush_slot(struct ftl_device *dev, int slot)
+{
+	u32 lpn = dev->buffer_list[slot];
+	PAGE_OP op = { .type = PAGE_OP_FLUSH, .lpn = lpn, .ref_time = dev->ref_time };
+
+	// flush, merged with the old page on its bank
+	memcpy(op.data, dev->buffer[slot], PAGE_DATA_SIZE);
+	op.valid = dev->buffer_valid[slot];
+	submit_page_op(dev, &op);
+
+	ghost_add(&dev->buffer_ghost, lpn);
+	buffer_release(dev, slot);
+}
+
+/*
+ *	Write a whole page straight to its bank, dropping the buffered copy
+ *	it replaces
+ */
+static void buffer_bypass(struct ftl_device *dev, u32 lpn, const u32 *data)
+{
+	PAGE_OP op = { .type = PAGE_OP_FLUSH, .lpn = lpn, .ref_time = dev->ref_time, .valid = SECTOR_MASK_ALL };
+	int slot = buffer_find(dev, lpn);
+
+	if (slot != -1)
+		buffer_release(dev, slot);
+	memcpy(op.data, data, PAGE_DATA_SIZE);
+	submit_page_op(dev, &op);
+	rcache_insert(&dev->rcache, lpn, data);
+	dev->host_stats.bypass_write++;
+}
+
+/*
+ *	Whether a write goes around the buffer, see geo.bypass_sectors
+ *
+ *	A write that starts where the last one ended continues its
+ *	sequential run. Once the run (or the write alone) reaches
+ *	bypass_sectors, its whole pages are written through.
+ */
+static bool write_bypass(struct ftl_device *dev, u32 lba, u32 nsect)
+{
+	dev->seq_run = lba == dev->seq_end ? dev->seq_run + nsect : nsect;
+	dev->seq_end = lba + nsect;
+	return dev->geo.bypass_sectors && dev->seq_run >= dev->geo.bypass_sectors;
+}
+
+/*
+ *	Make room in a full write buffer
+ *
+ *	The victim is the first slot in eviction order: the oldest write for
+ *	FTL_BUFFER_FIFO, the least recently written page for the others.
+ *	FTL_BUFFER_BLOCK also flushes every other buffered page of the
+ *	victim's block: the PAGES_PER_BLK LPNs of its bank, by index in the
+ *	bank, that fill one physical block. Pages written together leave
+ *	together and land next to each other.
+ */
+static void buffer_evict(struct ftl_device *dev)
+{
+	int victim = dev->buffer_order.first;
+	u32 bank, first;
+
+	if (dev->geo.buffer_policy != FTL_BUFFER_BLOCK) {
+		buffer_flush_slot(dev, victim);
+		return;
+	}
+
+	bank = lpn_bank(&dev->geo, dev->buffer_list[victim]);
+	first = lpn_bank_index(&dev->geo, dev->buffer_list[victim]);
+	first -= first % PAGES_PER_BLK;
+	for (u32 index = first; index < first + PAGES_PER_BLK && index < N_LPNS_PB; index++) {
+		int slot = buffer_find(dev, bank_index_lpn(&dev->geo, bank, index));
+		if (slot != -1)
+			buffer_flush_slot(dev, slot);
+	}
+}
+
+static int batch_entry_cmp(const void *a, const void *b)
+{
+	const BATCH_ENTRY *x = a, *y = b;
+
+	if (x->bank != y->bank)
+		return x->bank < y->bank ? -1 : 1;
+	if (x->map_page != y->map_page)
+		return x->map_page < y->map_page ? -1 : 1;
+	return x->lpn < y->lpn ? -1 : x->lpn > y->lpn;
+}
+
+/*
+ *	Flush up to geo.flush_batch of the window oldest buffered pages
+ *
+ *	Only the window oldest pages in eviction order are candidates (see
+ *	buffer_flush_window). Each bank takes the pages that share the map
+ *	page of its oldest candidate, up to its share of the batch. The
+ *	batch is submitted by bank, map page and LPN, so the banks flush in
+ *	parallel and each one updates a single cached map page for all of
+ *	its pages.
+ */
+static void buffer_flush_batch(struct ftl_device *dev, int window)
+{
+	int batch = dev->geo.flush_batch;
+	int per_bank = (batch + N_BANKS - 1) / N_BANKS;
+	int slot = dev->buffer_order.first;
+	int n = 0;
+
+	memset(dev->flush_taken, 0, sizeof(int) * N_BANKS);
+	for (int i = 0; i < window && slot != -1 && n < batch; i++, slot = dev->buffer_next[slot]) {
+		u32 lpn = dev->buffer_list[slot];
+		u32 bank = lpn_bank(&dev->geo, lpn);
+		u32 map_page = lpn_map_page(&dev->geo, lpn);
+
+		if (dev->flush_taken[bank] == 0)
+			dev->flush_map_page[bank] = map_page;
+		else if (dev->flush_taken[bank] == per_bank || dev->flush_map_page[bank] != map_page)
+			continue;
+		dev->flush_taken[bank]++;
+		dev->flush_batch[n++] = (BATCH_ENTRY){ .bank = bank, .map_page = map_page, .lpn = lpn, .slot = slot };
+	}
+
+	qsort(dev->flush_batch, n, sizeof(BATCH_ENTRY), batch_entry_cmp);
+	for (int i = 0; i < n; i++)
+		buffer_flush_slot(dev, dev->flush_batch[i].slot);
+}
+
+static bool buffer_above_watermark(struct ftl_device *dev)
+{
+	return dev->geo.flush_watermark && dev->buffer_count > 0 &&
+		   dev->buffer_count * 100 >= dev->geo.flush_watermark * dev->buffer_size;
+}
+
+/*
+ *	Candidates of a watermark flush: every buffered page but the newest,
+ *	which the next write of a sequential run may still be filling
+ */
+static int buffer_flush_window(struct ftl_device *dev)
+{
+	return dev->buffer_count > 1 ? dev->buffer_count - 1 : 1;
+}
+
+static void buffer_flush_all(struct ftl_device *dev)
+{
+	while (dev->buffer_count > 0)
+		buffer_flush_batch(dev, dev->buffer_count);
+}
+
+/*
+ *	Flush the buffered pages of a host write, for FTL_CMD_FUA
+ */
+static void buffer_flush_range(struct ftl_device *dev, u32 lba, u32 nsect)
+{
+	u32 start_page = lba / SECTORS_PER_PAGE;
+	u32 end_page = (lba + nsect + SECTORS_PER_PAGE - 1) / SECTORS_PER_PAGE;
+
+	for (u32 lpn = start_page; lpn < end_page; lpn++) {
+		int slot = buffer_find(dev, lpn);
+		if (slot != -1)
+			buffer_flush_slot(dev, slot);
+	}
+}
+
+/*
+ *	Background drain in simulated time
+ *
+ *	While every bank is idle before now, batches are flushed until the
+ *	buffer is down to geo.drain_watermark. They run in the gap between
+ *	host commands instead of on the miss of a later write.
+ */
+static void buffer_drain(struct ftl_device *dev, u64 now)
+{
+	while (dev->geo.drain_watermark &&
+		   dev->buffer_count * 100 > dev->geo.drain_watermark * dev->buffer_size) {
+		u64 idle = 0;
+
+		for (int bank = 0; bank < N_BANKS; bank++) {
+			if (nand_bank_free(dev->nand, bank) > idle)
+				idle = nand_bank_free(dev->nand, bank);
+		}
+		if (idle >= now)
+			break;
+		nand_set_clock(dev->nand, idle);
+		buffer_flush_batch(dev, dev->buffer_count - dev->geo.drain_watermark * dev->buffer_size / 100);
+	}
+}
+
+/*
+ *	Start a host read
+ *
+ *	Sectors found in the write buffer are copied out now. Pages that
+ *	still need flash are read by their banks into req->flash, so a
+ *	later write can not change what this read returns. They are sorted
+ *	by bank and map page first, and each bank gets one op for all of
+ *	its pages.
+ */
+static void read_start(struct ftl_device *dev, READ_REQ *req)
+{
+	u32 start_page = req->lba / SECTORS_PER_PAGE;
+	u32 end_page = (req->lba + req->nsect + SECTORS_PER_PAGE - 1) / SECTORS_PER_PAGE;
+	u32 npage = end_page - start_page;
+	u32 n_flash = 0;
+	u32 *out = req->out;
+	u32 offset;
+	u32 size;
+
+	dram_tick(dev);
+	req->pending = 0;
+	req->gen = dev->rcache.gen;
+	req->flash = malloc(PAGE_DATA_SIZE * npage);
+	req->from_buffer = malloc(sizeof(SECTOR_MASK) * npage);
+	req->batch = malloc(sizeof(BATCH_ENTRY) * npage);
+
+	for (u32 i = 0 ; i < npage; i++) {
+		u32 lpn = start_page + i;
+		SECTOR_MASK want, hit = 0;
+		int slot;
+
+		page_range(req->lba, req->nsect, lpn, &offset, &size);
+		want = sector_range(offset, size);
+
+		// buffer에 있는지 확인 
+		slot = buffer_find(dev, lpn);
+		if (slot != -1) {
+			hit = dev->buffer_valid[slot] & want;
+			merge_sectors(out, dev->buffer[slot] + offset, hit >> offset, size);
+		}
+		if (hit != want && dev->rcache.size) {
+			const u32 *cached = rcache_lookup(&dev->rcache, lpn);
+
+			if (cached) {
+				merge_sectors(out, cached + offset, (want & ~hit) >> offset, size);
+				hit = want;
+				dev->host_stats.read_cache_hit++;
+			} else {
+				dev->host_stats.read_cache_miss++;
+			}
+		}
+		if (hit != want)
+			ghost_hit(&dev->rcache.dropped, lpn);
+		req->from_buffer[i] = hit;
+
+		// buffer에 없거나 일부만 있는 page는 bank에서 read
+		if (hit != want)
+			req->batch[n_flash++] = (BATCH_ENTRY){ .bank = lpn_bank(&dev->geo, lpn),
+												   .map_page = lpn_map_page(&dev->geo, lpn),
+												   .lpn = lpn, .slot = i };
+		out += size;
+	}
+
+	// one op per bank, each map page of it looked up once
+	if (n_flash > 1)
+		qsort(req->batch, n_flash, sizeof(BATCH_ENTRY), batch_entry_cmp);
+	for (u32 k = 0, next; k < n_flash; k = next) {
+		for (next = k + 1; next < n_flash && req->batch[next].bank == req->batch[k].bank; next++)
+			;
+		PAGE_OP op = { .type = PAGE_OP_READ, .lpn = req->batch[k].lpn, .ref_time = dev->ref_time,
+					   .out = req->flash, .pending = &req->pending,
+					   .batch = req->batch + k, .n = next - k };
+		submit_page_op(dev, &op);
+	}
+}
+
+static bool read_done(READ_REQ *req)
+{
+	return __atomic_load_n(&req->pending, __ATOMIC_ACQUIRE) == 0;
+}
+
+/*
+ *	Fill the sectors of a started read that come from flash
+ */
+static void read_finish(struct ftl_device *dev, READ_REQ *req)
+{
+	u32 start_page = req->lba / SECTORS_PER_PAGE;
+	u32 end_page = (req->lba + req->nsect + SECTORS_PER_PAGE - 1) / SECTORS_PER_PAGE;
+	u32 *out = req->out;
+	u32 offset;
+	u32 size;
+
+	for (u32 i = 0 ; i < end_page - start_page; i++) {
+		u32 *page = req->flash + i * SECTORS_PER_PAGE;
+		int slot;
+
+		page_range(req->lba, req->nsect, start_page + i, &offset, &size);
+		merge_sectors(out, page + offset, ~req->from_buffer[i] >> offset, size);
+		out += size;
+
+		// cache what was read from flash, unless a write came in between;
+		// buffered sectors are newer than flash
+		if (req->from_buffer[i] != sector_range(offset, size) && req->gen == dev->rcache.gen) {
+			if ((slot = buffer_find(dev, start_page + i)) != -1)
+				merge_sectors(page, dev->buffer[slot], dev->buffer_valid[slot], SECTORS_PER_PAGE);
+			rcache_insert(&dev->rcache, start_page + i, page);
+		}
+	}
+
+	free(req->flash);
+	free(req->from_buffer);
+	free(req->batch);
+	dev->host_stats.host_read += req->nsect;
+}
+
+void ftl_read(struct ftl_device *dev, u32 lba, u32 nsect, u32 *read_buffer)
+{
+	READ_REQ req = { .lba = lba, .nsect = nsect, .out = read_buffer };
+
+	pthread_mutex_lock(&dev->host_lock);
+	read_start(dev, &req);
+	wait_page_ops(dev, &req.pending);
+	read_finish(dev, &req);
+	pthread_mutex_unlock(&dev->host_lock);
+}
+
+static void buffer_write(struct ftl_device *dev, u32 lba, u32 nsect, u32 *write_buffer)
+{
+	u32 start_page = lba / SECTORS_PER_PAGE;
+	u32 end_page = (lba + nsect + SECTORS_PER_PAGE - 1) / SECTORS_PER_PAGE;
+	bool bypass = write_bypass(dev, lba, nsect);
+	u32 offset;
+	u32 size;
+
+	dram_tick(dev);
+	for (u32 lpn = start_page; lpn < end_page; lpn++) {
+		int slot;
+
+		// whole pages of a large or sequential write skip the buffer;
+		// consecutive LPNs go to the banks in turn
+		page_range(lba, nsect, lpn, &offset, &size);
+		if (bypass && size == SECTORS_PER_PAGE) {
+			buffer_bypass(dev, lpn, write_buffer);
+			write_buffer += size;
+			continue;
+		}
+
+		slot = buffer_find(dev, lpn);
+		if (slot != -1) {
+			// hit
+			dev->host_stats.buffer_hit++;
+			if (dev->geo.buffer_policy != FTL_BUFFER_FIFO) {
+				buffer_unlink(dev, slot);
+				buffer_append(dev, slot);
+			}
+		} else {
+			// miss, buffer에 넣기
+			dev->host_stats.buffer_miss++;
+			ghost_hit(&dev->buffer_ghost, lpn);
+			if (dev->buffer_count >= dev->buffer_size) {
+				if (dev->geo.flush_watermark)
+					buffer_flush_batch(dev, buffer_flush_window(dev));
+				else
+					buffer_evict(dev);
+			}
+
+			// only the written sectors are valid, the old page is merged
+			// in once at flush (exec_page_op)
+			slot = dev->buffer_free;
+			dev->buffer_free = dev->buffer_next[slot];
+			dev->buffer_list[slot] = lpn;
+			lpn_index_add(&dev->buffer_index, lpn, slot);
+			buffer_append(dev, slot);
+			dev->buffer_count++;
+		}
+
+		// buffer에 write
+		memcpy(dev->buffer[slot] + offset, write_buffer, size * SECTOR_SIZE);
+		dev->buffer_valid[slot] |= sector_range(offset, size);
+		rcache_update(&dev->rcache, lpn, dev->buffer[slot], sector_range(offset, size));
+		write_buffer += size;
+	}
+	dev->rcache.gen++;
+
+	while (buffer_above_watermark(dev))
+		buffer_flush_batch(dev, buffer_flush_window(dev));
+
+	dev->host_stats.host_write += nsect;
+	dev->ref_time++;
+}
+
+void ftl_write(struct ftl_device *dev, u32 lba, u32 nsect, u32 *write_buffer)
+{
+	pthread_mutex_lock(&dev->host_lock);
+	buffer_write(dev, lba, nsect, write_buffer);
+	pthread_mutex_unlock(&dev->host_lock);
+}
+
+/*
+ * write every buffered page to flash and wait until the banks are done
+ */
+void ftl_flush(struct ftl_device *dev)
+{
+	unsigned long *mark = malloc(sizeof(unsigned long) * (dev->n_workers + 1));
+
+	pthread_mutex_lock(&dev->host_lock);
+	buffer_flush_all(dev);
+	wait_queued_ops(dev, mark);
+	pthread_mutex_unlock(&dev->host_lock);
+	free(mark);
+}
+
+/*
+ * read, write or flush in simulated time
+ * @now: arrival of the command in ns
+ *
+ * The command runs like ftl_read/ftl_write/ftl_flush, with its NAND
+ * operations placed on the banks' timelines from now on (see
+ * nand_set_clock). A write that only fills the buffer ends at now, one that evicts
+ * pages ends with their flushes, and a flush with the last of all
+ * buffered pages. With geo.drain_watermark, banks that go idle before
+ * now first drain the buffer (buffer_drain). Needs N_WORKERS=0, so
+ * that every page op is done before the call returns.
+ *
+ * Returns:
+ *   the time the command completes in ns
+ */
+u64 ftl_timed_read(struct ftl_device *dev, u64 now, u32 lba, u32 nsect, u32 *read_buffer)
+{
+	u64 done;
+
+	pthread_mutex_lock(&dev->host_lock);
+	buffer_drain(dev, now);
+	nand_set_clock(dev->nand, now);
+
+	READ_REQ req = { .lba = lba, .nsect = nsect, .out = read_buffer };
+	read_start(dev, &req);
+	wait_page_ops(dev, &req.pending);
+	read_finish(dev, &req);
+
+	done = nand_last_end(dev->nand);
+	pthread_mutex_unlock(&dev->host_lock);
+	return done;
+}
+
+u64 ftl_timed_write(struct ftl_device *dev, u64 now, u32 lba, u32 nsect, u32 *write_buffer)
+{
+	u64 done;
+
+	pthread_mutex_lock(&dev->host_lock);
+	buffer_drain(dev, now);
+	nand_set_clock(dev->nand, now);
+	buffer_write(dev, lba, nsect, write_buffer);
+	done = nand_last_end(dev->nand);
+	pthread_mutex_unlock(&dev->host_lock);
+	return done;
+}
+
+u64 ftl_timed_flush(struct ftl_device *dev, u64 now)
+{
+	u64 done;
+
+	pthread_mutex_lock(&dev->host_lock);
+	nand_set_clock(dev->nand, now);
+	buffer_flush_all(dev);
+	done = nand_last_end(dev->nand);
+	pthread_mutex_unlock(&dev->host_lock);
+	return done;
+}
+
+/*
+ * total simulated time a bank spent on NAND operations in ns
+ */
+u64 ftl_bank_busy(struct ftl_device *dev, int bank)
+{
+	return nand_bank_busy(dev->nand, bank);
+}
+
+/*
+ * total simulated time a channel bus spent on page transfers in ns
+ */
+u64 ftl_channel_busy(struct ftl_device *dev, int channel)
+{
+	return nand_channel_busy(dev->nand, channel);
+}
+
+/*
+ * create a queue pair on a device
+ * @qp: set to the new queue pair
+ * @depth: most commands outstanding at once
+ *
+ * Returns:
+ *   0 on success
+ *   FTL_ERR_INVALID if depth is not positive
+ */
+int ftl_qpair_create(struct ftl_device *dev, struct ftl_qpair **qp_, int depth)
+{
+	struct ftl_qpair *qp;
+	unsigned int size = 1;
+
+	if (depth <= 0)
+		return FTL_ERR_INVALID;
+	while (size < depth)
+		size <<= 1;
+
+	qp = calloc(1, sizeof(struct ftl_qpair));
+	qp->dev = dev;
+	qp->depth = depth;
+	ftl_ring_init(&qp->sq, size, sizeof(struct ftl_cmd));
+	ftl_ring_init(&qp->cq, size, sizeof(struct ftl_cpl));
+	qp->reads = calloc(depth, sizeof(QP_READ));
+	qp->mark = malloc(sizeof(unsigned long) * (dev->n_workers + 1));
+
+	*qp_ = qp;
+	return FTL_SUCCESS;
+}
+
+/*
+ * free a queue pair, outstanding commands are completed and dropped
+ */
+void ftl_qpair_destroy(struct ftl_qpair *qp)
+{
+	struct ftl_cpl cpl;
+
+	while (qp->outstanding > 0) {
+		if (ftl_poll(qp, &cpl, 1) == 0)
+			ftl_qpair_wait(qp);
+	}
+
+	ftl_ring_free(&qp->sq);
+	ftl_ring_free(&qp->cq);
+	free(qp->reads);
+	free(qp->mark);
+	free(qp);
+}
+
+/*
+ * queue a command, it is started by the next ftl_poll
+ *
+ * Returns:
+ *   0 on success
+ *   FTL_ERR_BUSY if depth commands are outstanding
+ */
+int ftl_submit(struct ftl_qpair *qp, const struct ftl_cmd *cmd)
+{
+	if (qp->outstanding == qp->depth)
+		return FTL_ERR_BUSY;
+
+	ftl_ring_push(&qp->sq, cmd);
+	qp->outstanding++;
+	return FTL_SUCCESS;
+}
+
+static void post_cpl(struct ftl_qpair *qp, u32 tag)
+{
+	struct ftl_cpl cpl = { .tag = tag, .status = FTL_SUCCESS };
+
+	ftl_ring_push(&qp->cq, &cpl);
+}
+
+/*
+ * start queued commands and reap completions
+ * @cpl: filled with up to max completions
+ *
+ * Writes complete once they are in the write buffer. Reads complete
+ * when all of their banks are done, so commands may complete out of
+ * order. FUA writes and flushes wait here until their pages are
+ * programmed, and complete before the poll returns. host_lock is
+ * dropped while they wait, so other queue pairs are not held up.
+ *
+ * Returns:
+ *   number of completions
+ */
+int ftl_poll(struct ftl_qpair *qp, struct ftl_cpl *cpl, int max)
+{
+	struct ftl_device *dev = qp->dev;
+	struct ftl_cmd cmd;
+	int n = 0;
+
+	pthread_mutex_lock(&dev->host_lock);
+	while (ftl_ring_pop(&qp->sq, &cmd)) {
+		if (cmd.opcode == FTL_CMD_WRITE) {
+			buffer_write(dev, cmd.lba, cmd.nsect, cmd.buf);
+			if (cmd.flags & FTL_CMD_FUA) {
+				buffer_flush_range(dev, cmd.lba, cmd.nsect);
+				wait_queued_ops(dev, qp->mark);
+			}
+			post_cpl(qp, cmd.tag);
+			continue;
+		}
+		if (cmd.opcode == FTL_CMD_FLUSH) {
+			buffer_flush_all(dev);
+			wait_queued_ops(dev, qp->mark);
+			post_cpl(qp, cmd.tag);
+			continue;
+		}
+
+		// at most depth commands are outstanding, so a slot is free
+		QP_READ *r = qp->reads;
+		while (r->busy)
+			r++;
+		r->busy = true;
+		r->tag = cmd.tag;
+		r->req = (READ_REQ){ .lba = cmd.lba, .nsect = cmd.nsect, .out = cmd.buf };
+		read_start(dev, &r->req);
+	}
+
+	for (int i = 0; i < qp->depth; i++) {
+		QP_READ *r = &qp->reads[i];
+		if (r->busy && read_done(&r->req)) {
+			read_finish(dev, &r->req);
+			r->busy = false;
+			post_cpl(qp, r->tag);
+		}
+	}
+	pthread_mutex_unlock(&dev->host_lock);
+
+	while (n < max && ftl_ring_pop(&qp->cq, &cpl[n]))
+		n++;
+	qp->outstanding -= n;
+	return n;
+}
+
+static bool qpair_ready(void *arg)
+{
+	struct ftl_qpair *qp = arg;
+	bool busy = false;
+
+	if (!ftl_ring_empty(&qp->sq) || !ftl_ring_empty(&qp->cq))
+		return true;
+	for (int i = 0; i < qp->depth; i++) {
+		if (qp->reads[i].busy) {
+			if (read_done(&qp->reads[i].req))
+				return true;
+			busy = true;
+		}
+	}
+	return !busy;
+}
+
+/*
+ * sleep until the next ftl_poll has something to do: a read of the
+ * queue pair is done, or commands are waiting to start or be reaped
+ *
+ * Lets a poll loop give the CPU to the bank workers instead of spinning.
+ */
+void ftl_qpair_wait(struct ftl_qpair *qp)
+{
+	wait_until(qp->dev, qpair_ready, qp);
+}
+
+/*
+ *	Full data blocks of a bank, GC starts when only N_GC_BLOCKS are left
+ */
+static u32 count_full_data(struct ftl_device *dev, u32 bank)
+{
+	u32 nfull_data = 0;
+
+	for (int j = 0 ; j < BLKS_PER_BANK ; j++) {
+		if (dev->blk_state[bank][j].full == true 
+			&& dev->blk_state[bank][j].area == DATA_BLOCK) 
+		{
+			nfull_data++;
 		}
 	}
-	read_buffer -= nsect;
-	free(read_data);
-	free(lpn);
-	stats.host_read += nsect;
-	return;
+	return nfull_data;
 }
 
-void ftl_write(u32 lba, u32 nsect, u32 *write_buffer)
+static u32 count_full_map(struct ftl_device *dev, u32 bank)
 {
-	/* stats.nand_write++ every nand_write call*/
-	int *lpn = malloc(sizeof(int));
-	u32 D_ppn = 0;
-	int bank;
-	int D_block;
-	int D_page;
-	int old_D_ppn = -1;
-	int old_bank;
-	int old_block;
-	int old_page;
-	u32 *write_data = malloc(PAGE_DATA_SIZE);
+	u32 nfull_tr = 0;
 
-	int end_page = (lba + nsect) / SECTORS_PER_PAGE;
-	if ((lba + nsect) % SECTORS_PER_PAGE != 0)
-		end_page++;
+	for (int j = 0 ; j < BLKS_PER_BANK ; j++) {
+		if (dev->blk_state[bank][j].full == true 
+			&& dev->blk_state[bank][j].area == TR_BLOCK)
+			nfull_tr++;
+	}
+	return nfull_tr;
+}
 
-	int start_page = lba / SECTORS_PER_PAGE;
-	int npage = end_page - start_page;
-	int offset;
-	int size;
-	int n_hit = 0;
-	bool hit = false;
-
-	*lpn = (lba / SECTORS_PER_PAGE);
-
-	for (int i = start_page; i < end_page; i++) {
-		hit = false;
-		for (int j = 0; j < *buffer_count; j++) {
-			if (buffer_list[j] == i) {
-				// hit
-				hit = true;
-				n_hit++;
-
-				// buffer에 write
-				if (i == start_page) {
-					offset = lba % SECTORS_PER_PAGE;
-					
-					if (nsect + offset < SECTORS_PER_PAGE)
-						size = nsect * SECTOR_SIZE;
-					else 
-						size = PAGE_DATA_SIZE - offset * SECTOR_SIZE;
-
-					memcpy(buffer[j] + offset, write_buffer, size);
-					(*buffer_count)++;
-					
-					for (int k = offset ; k < offset + size / SECTOR_SIZE ; k++)
-						buffer_sector_valid[j][k] = true;
-					
-					write_buffer += size / SECTOR_SIZE;
-				} else if (i == end_page - 1) {
-					offset = (lba + nsect) % SECTORS_PER_PAGE;
-					if (offset == 0) {
-						size = PAGE_DATA_SIZE;
-						memcpy(buffer[j], write_buffer, size);
-						(*buffer_count)++;
-					}
-					else {
-						size = offset * SECTOR_SIZE;
-						memcpy(buffer[j], write_buffer, size);
-						(*buffer_count)++;
-					}
-					for (int k = 0 ; k < size / SECTOR_SIZE ; k++)
-						buffer_sector_valid[j][k] = true;
-				} else {
-					size = PAGE_DATA_SIZE;
-					memcpy(buffer[j], write_buffer, size);
-					(*buffer_count)++;
-					write_buffer += SECTORS_PER_PAGE;
-
-					for (int k = 0 ; k < size / SECTOR_SIZE ; k++)
-						buffer_sector_valid[j][k] = true;
-				}
+static u32 count_empty(struct ftl_device *dev, u32 bank)
+{
+	u32 nempty = 0;
 
-				break;
-			}
-		}
+	for (int j = 0 ; j < BLKS_PER_BANK ; j++) {
+		if (dev->blk_state[bank][j].area == 0)
+			nempty++;
+	}
+	return nempty;
+}
 
-		if (hit == true) 
-			continue;
-		else {
-			// miss, buffer에 넣기
-			if (*buffer_count == N_BUFFERS) {
+static void split_record(struct ftl_device *dev, u32 bank)
+{
+	BANK_SPLIT *sp = &dev->split[bank];
 
-				// Buffer 필요한 만큼 비우기
-				int n_victim = 1;
-				for (int i = 0; i < n_victim; i++) {
-					u32 v_lpn = buffer_list[i];
-					bank = v_lpn % N_BANKS;
-					memset(write_data, -1, PAGE_DATA_SIZE);
+	if (sp->n_history == sp->history_size) {
+		sp->history_size = sp->history_size ? sp->history_size * 2 : 16;
+		sp->history = realloc(sp->history, sizeof(struct ftl_split_sample) * sp->history_size);
+	}
+	sp->history[sp->n_history++] = (struct ftl_split_sample){
+		.host_pages = dev->bank_stats[bank].nand_write,
+		.data_blocks = sp->data_blocks,
+		.map_blocks = sp->map_blocks,
+	};
+}
 
-					read(v_lpn * SECTORS_PER_PAGE, SECTORS_PER_PAGE, write_data);
+/*
+ *	Initial split of a bank
+ *
+ *	Each pool may use one block more than its size while its GC runs, so
+ *	the OP blocks beyond those two are shared out by USER_OP_RATIO.
+ */
+static void split_init(struct ftl_device *dev, u32 bank)
+{
+	BANK_SPLIT *sp = &dev->split[bank];
+	int spare = N_OP_BLOCKS_PB - 2;
+
+	sp->data_blocks = N_USER_BLOCKS_PB;
+	sp->map_blocks = N_MAP_BLOCKS_PB;
+	sp->dir = -1;
+	sp->window = SPLIT_WINDOW;
+	if (dev->geo.adaptive_split && !dev->geo.superblock && spare > 0) {
+		sp->data_blocks += (int)(spare * USER_OP_RATIO);
+		sp->map_blocks += spare - (int)(spare * USER_OP_RATIO);
+	}
+	split_record(dev, bank);
+}
 
-					for (int j = 0; j < SECTORS_PER_PAGE; j++) {
-						if (buffer_sector_valid[i][j] == true) {
-							write_data[j] = buffer[i][j];
-						}
-					}
+/*
+ *	Split controller, called after every GC of a bank
+ *
+ *	Hill climbing on write amplification: every window of GCs one block
+ *	moves between the pools, and the NAND writes per host page written
+ *	in the next window are compared with the window before the move. A
+ *	move that made it worse is taken back and the window doubles, so a
+ *	bank that sits at its best split stops paying for probes. A pool
+ *	never drops below its fixed size, and gives up a block only while it
+ *	stays below its GC threshold, so the threshold is still met exactly.
+ */
+static void split_update(struct ftl_device *dev, u32 bank)
+{
+	BANK_SPLIT *sp = &dev->split[bank];
+	struct ftl_stats *b = &dev->bank_stats[bank];
+	struct ftl_stats *l = &sp->last;
+	long host = b->nand_write - l->nand_write;
+	double waf;
+
+	if (!dev->geo.adaptive_split || dev->geo.superblock || ++sp->events < sp->window)
+		return;
+
+	waf = (double)(host + b->gc_write - l->gc_write + b->map_write - l->map_write +
+				   b->map_gc_write - l->map_gc_write) / (host ? host : 1);
+	// a move that made things worse is undone, and tried again later
+	if (sp->moved && waf > sp->waf) {
+		sp->dir = -sp->dir;
+		if (sp->window < SPLIT_WINDOW_MAX)
+			sp->window *= 2;
+	}
+	sp->waf = waf;
+	sp->events = 0;
+	sp->last = *b;
+	sp->moved = false;
+
+	// partly written blocks left by GC also take room, keep some empty
+	if (count_empty(dev, bank) <= SPLIT_RESERVE)
+		return;
+
+	if (sp->dir > 0 && sp->map_blocks > N_MAP_BLOCKS_PB &&
+		count_full_map(dev, bank) + N_GC_BLOCKS < sp->map_blocks) {
+		sp->map_blocks--;
+		sp->data_blocks++;
+	} else if (sp->dir < 0 && sp->data_blocks > N_USER_BLOCKS_PB &&
+			   count_full_data(dev, bank) + N_GC_BLOCKS < sp->data_blocks) {
+		sp->data_blocks--;
+		sp->map_blocks++;
+	} else {
+		// at a limit, try the other way next time
+		if (sp->dir > 0 ? sp->map_blocks == N_MAP_BLOCKS_PB : sp->data_blocks == N_USER_BLOCKS_PB)
+			sp->dir = -sp->dir;
+		return;
+	}
+	sp->moved = true;
+	split_record(dev, bank);
+}
 
-					// flush
-					write(v_lpn * SECTORS_PER_PAGE, SECTORS_PER_PAGE, write_data);
-				}
+/*
+ * data / map block split of a bank over time
+ * @samples: set to the split at open and after each change, in order
+ *
+ * Returns:
+ *   number of samples
+ */
+int ftl_get_split_history(struct ftl_device *dev, int bank, const struct ftl_split_sample **samples)
+{
+	pthread_mutex_lock(&dev->host_lock);
+	wait_page_ops(dev, &dev->inflight);
+	pthread_mutex_unlock(&dev->host_lock);
 
-				// Buffer 재배열
-				for (int j = 0 ; j < *buffer_count - n_victim ; j++) {
-					buffer_list[j] = buffer_list[j + n_victim];
-					memcpy(buffer[j], buffer[j + n_victim], PAGE_DATA_SIZE);
-					memcpy(buffer_sector_valid[j], buffer_sector_valid[j + n_victim], sizeof(bool) * SECTORS_PER_PAGE);
-				}
-				
-				(*buffer_count) -= n_victim;
-
-				// 비운 buffer init
-				for (int j = *buffer_count ; j < N_BUFFERS ; j++) {
-					for (int k = 0 ; k < SECTORS_PER_PAGE ; k++) {
-						buffer_sector_valid[j][k] = false;
-					}
-					memset(buffer[j], -1, PAGE_DATA_SIZE);
-					buffer_list[j] = -1;
-				}
-			}
-						
-			read((*lpn) * SECTORS_PER_PAGE, SECTORS_PER_PAGE, buffer[*buffer_count]);
-
-			// buffer에 write
-			if (i == start_page) {
-				offset = lba % SECTORS_PER_PAGE;
-				
-				if (nsect + offset < SECTORS_PER_PAGE)
-					size = nsect * SECTOR_SIZE;
-				else 
-					size = PAGE_DATA_SIZE - offset * SECTOR_SIZE;
-
-				memcpy(buffer[*buffer_count] + offset, write_buffer, size);
-				(*buffer_count)++;
-				
-				for (int j = offset ; j < offset + size / SECTOR_SIZE ; j++)
-					buffer_sector_valid[*buffer_count][j] = true;
-				
-				write_buffer += size / SECTOR_SIZE;
-			} else if (i == end_page - 1) {
-				offset = (lba + nsect) % SECTORS_PER_PAGE;
-				if (offset == 0) {
-					size = PAGE_DATA_SIZE;
-					memcpy(buffer[*buffer_count], write_buffer, size);
-					(*buffer_count)++;
-				}
-				else {
-					size = offset * SECTOR_SIZE;
-					memcpy(buffer[*buffer_count], write_buffer, size);
-					(*buffer_count)++;
-				}
-				for (int j = 0 ; j < size / SECTOR_SIZE ; j++)
-					buffer_sector_valid[*buffer_count][j] = true;
-			} else {
-				size = PAGE_DATA_SIZE;
-				memcpy(buffer[*buffer_count], write_buffer, size);
-				(*buffer_count)++;
-				write_buffer += SECTORS_PER_PAGE;
+	*samples = dev->split[bank].history;
+	return dev->split[bank].n_history;
+}
 
-				for (int j = 0 ; j < size / SECTOR_SIZE ; j++)
-					buffer_sector_valid[*buffer_count][j] = true;
-			}
-			
-			int valid_count = 0;
-			for (int j = 0 ; j < SECTORS_PER_PAGE ; j++) {
-				if (buffer_sector_valid[*buffer_count][j] == true)
-					valid_count++;
-			}
+/*
+ * Parts of the DRAM budget, see dram_update
+ */
+#define DRAM_BUFFER		0
+#define DRAM_READ_CACHE	1
+#define DRAM_CMT		2
+#define DRAM_PARTS		3
 
-			buffer_list[*buffer_count] = *lpn;
-			(*buffer_count)++;
-			(*lpn)++;
-		}
+static void dram_record(struct ftl_device *dev)
+{
+	if (dev->n_dram_history == dev->dram_history_size) {
+		dev->dram_history_size = dev->dram_history_size ? dev->dram_history_size * 2 : 16;
+		dev->dram_history = realloc(dev->dram_history, sizeof(struct ftl_dram_sample) * dev->dram_history_size);
 	}
+	dev->dram_history[dev->n_dram_history++] = (struct ftl_dram_sample){
+		.host_cmds = dev->host_cmds,
+		.buffer_pages = dev->buffer_size,
+		.read_cache_pages = dev->rcache.size,
+		.cmt_pages = N_BANKS * dev->cmt_budget / PAGE_DATA_SIZE,
+	};
+}
 
-	
+/*
+ *	Sizes of the write buffer and CMT at open
+ *
+ *	Fixed at N_BUFFERS and CMT_BUDGET_PB unless geo.adaptive_dram. With
+ *	it, the pools are allocated for the largest share each part may get:
+ *	all of the budget for the write buffer and read cache, and for CMT
+ *	as many slots as the bank has map pages.
+ */
+static void dram_init(struct ftl_device *dev)
+{
+	int cmt_slots;
+
+	dev->cmt_budget = CMT_BUDGET_PB;
+	dev->n_cmt_slots = N_CMT_SLOTS_PB;
+	dev->buffer_size = N_BUFFERS;
+	dev->buffer_slots = N_BUFFERS;
+	dev->cmt_ghost = calloc(N_BANKS, sizeof(GHOST_LIST));
+	if (!dev->geo.adaptive_dram)
+		return;
+
+	dev->dram_pages = N_BUFFERS + dev->geo.read_cache + N_BANKS * dev->cmt_budget / PAGE_DATA_SIZE;
+	// CMT moves by one page per bank
+	dev->dram_step = dev->dram_pages / DRAM_STEPS / N_BANKS * N_BANKS;
+	if (dev->dram_step == 0)
+		dev->dram_step = N_BANKS;
+	dev->buffer_slots = dev->dram_pages;
+	cmt_slots = dev->dram_pages / N_BANKS * N_MAP_EXTENTS_PER_PAGE;
+	if (cmt_slots > N_MAP_PAGES_PB)
+		cmt_slots = N_MAP_PAGES_PB;
+	if (cmt_slots > dev->n_cmt_slots)
+		dev->n_cmt_slots = cmt_slots;
+
+	ghost_init(&dev->buffer_ghost, dev->dram_step);
+	for (int bank = 0; bank < N_BANKS; bank++)
+		ghost_init(&dev->cmt_ghost[bank], dev->dram_step / N_BANKS * N_MAP_EXTENTS_PER_PAGE);
+}
 
-	
+/*
+ *	Give pages (or take them back if negative) to one part
+ *
+ *	The write buffer flushes what no longer fits and the read cache
+ *	drops it; CMT evicts down to its new budget on the next load.
+ */
+static void dram_resize(struct ftl_device *dev, int part, int pages)
+{
+	switch (part) {
+	case DRAM_BUFFER:
+		dev->buffer_size += pages;
+		while (dev->buffer_count > dev->buffer_size)
+			buffer_evict(dev);
+		break;
+	case DRAM_READ_CACHE:
+		rcache_resize(&dev->rcache, dev->rcache.size + pages);
+		break;
+	case DRAM_CMT:
+		dev->cmt_budget += pages / N_BANKS * PAGE_DATA_SIZE;
+		break;
+	}
+}
 
-/* 	// Buffer에 넣기
-	if (npage - n_hit <= N_BUFFERS) {
-
-		// Buffer 필요한 만큼 비우기
-		if (npage - n_hit > N_BUFFERS - *buffer_count) {
-			int n_victim = npage - (N_BUFFERS - *buffer_count);
-			for (int i = 0; i < n_victim; i++) {
-				*lpn = buffer_list[i];
-				bank = *lpn % N_BANKS;
-				memset(write_data, -1, PAGE_DATA_SIZE);
-
-				for (int j = 0; j < SECTORS_PER_PAGE; j++) {
-					if (buffer_sector_valid[i][j] == true) {
-						write_data[j] = buffer[i][j];
-					}
-				}
+/*
+ *	DRAM split controller, called every DRAM_INTERVAL host commands
+ *
+ *	Each part keeps a ghost list of the last dram_step pages it dropped,
+ *	so its ghost hits since the last look are the misses one more step
+ *	of DRAM would have saved. CMT keeps N_MAP_EXTENTS_PER_PAGE map pages
+ *	per page of the step, split over the banks, as that many fit when
+ *	they are compressed. Weighted by the NAND time of such a miss, a program for the
+ *	write buffer and a read for the others, that is the marginal gain
+ *	of each part. One step moves from the part with the lowest gain to
+ *	the one with the highest. The write buffer keeps at least one page
+ *	and CMT one page per bank.
+ */
+static void dram_update(struct ftl_device *dev)
+{
+	long gain[DRAM_PARTS];
+	int give[DRAM_PARTS];
+	int take[DRAM_PARTS];
+	u32 cmt_max = N_MAP_PAGES_PB * PAGE_DATA_SIZE;
+	int from = -1, to = -1;
+	int pages;
+
+	// CMT and its ghosts belong to the banks
+	wait_page_ops(dev, &dev->inflight);
+
+	gain[DRAM_BUFFER] = dev->buffer_ghost.hits * dev->geo.t_prog;
+	gain[DRAM_READ_CACHE] = dev->rcache.dropped.hits * dev->geo.t_read;
+	gain[DRAM_CMT] = 0;
+	for (int bank = 0; bank < N_BANKS; bank++) {
+		gain[DRAM_CMT] += dev->cmt_ghost[bank].hits * dev->geo.t_read;
+		dev->cmt_ghost[bank].hits = 0;
+	}
+	dev->buffer_ghost.hits = 0;
+	dev->rcache.dropped.hits = 0;
+
+	give[DRAM_BUFFER] = dev->buffer_size - 1;
+	take[DRAM_BUFFER] = dev->buffer_slots - dev->buffer_size;
+	give[DRAM_READ_CACHE] = dev->rcache.size;
+	take[DRAM_READ_CACHE] = dev->rcache.capacity - dev->rcache.size;
+	give[DRAM_CMT] = (dev->cmt_budget - PAGE_DATA_SIZE) / PAGE_DATA_SIZE * N_BANKS;
+	take[DRAM_CMT] = dev->cmt_budget < cmt_max ? (cmt_max - dev->cmt_budget) / PAGE_DATA_SIZE * N_BANKS : 0;
+
+	for (int i = 0; i < DRAM_PARTS; i++) {
+		if (take[i] > 0 && (to == -1 || gain[i] > gain[to]))
+			to = i;
+	}
+	for (int i = 0; i < DRAM_PARTS; i++) {
+		if (i != to && give[i] > 0 && (from == -1 || gain[i] < gain[from]))
+			from = i;
+	}
+	if (to == -1 || from == -1 || gain[to] <= gain[from])
+		return;
+
+	pages = dev->dram_step;
+	if (pages > give[from])
+		pages = give[from];
+	if (pages > take[to])
+		pages = take[to];
+	if (from == DRAM_CMT || to == DRAM_CMT)
+		pages -= pages % N_BANKS;
+	if (pages == 0)
+		return;
+
+	dram_resize(dev, from, -pages);
+	dram_resize(dev, to, pages);
+	dram_record(dev);
+}
 
-				// flush
-				write((*lpn) * SECTORS_PER_PAGE, SECTORS_PER_PAGE, write_data);
-			}
+static void dram_tick(struct ftl_device *dev)
+{
+	if (!dev->geo.adaptive_dram)
+		return;
+	if (dev->host_cmds++ % DRAM_INTERVAL == DRAM_INTERVAL - 1)
+		dram_update(dev);
+}
 
-			// Buffer 재배열
-			for (int j = 0 ; j < *buffer_count - n_victim ; j++) {
-				buffer_list[j] = buffer_list[j + n_victim];
-				memcpy(buffer[j], buffer[j + n_victim], PAGE_DATA_SIZE);
-				memcpy(buffer_sector_valid[j], buffer_sector_valid[j + n_victim], sizeof(bool) * SECTORS_PER_PAGE);
-			}
-			
-			(*buffer_count) -= n_victim;
+/*
+ * DRAM split over time
+ * @samples: set to the split at open and after each change, in order
+ *
+ * Returns:
+ *   number of samples, 0 without ADAPTIVE_DRAM
+ */
+int ftl_get_dram_history(struct ftl_device *dev, const struct ftl_dram_sample **samples)
+{
+	pthread_mutex_lock(&dev->host_lock);
+	wait_page_ops(dev, &dev->inflight);
+	pthread_mutex_unlock(&dev->host_lock);
 
-			// 비운 buffer init
-			for (int j = *buffer_count ; j < N_BUFFERS ; j++) {
-				for (int k = 0 ; k < SECTORS_PER_PAGE ; k++) {
-					buffer_sector_valid[j][k] = false;
-				}
-				memset(buffer[j], -1, PAGE_DATA_SIZE);
-				buffer_list[j] = -1;
-			}
-		}
+	*samples = dev->dram_history;
+	return dev->n_dram_history;
+}
 
-		int start = *buffer_count;
-		int n = start;
-		*lpn = (lba / SECTORS_PER_PAGE);
-		
-		// Buffer에 넣기
-		for (int i = 0 ; i < npage ; i++) {
-			int tmp = -1;
-			for (int j = 0 ; j < *buffer_count ; j++) {
-				if (buffer_list[j] == *lpn) {
-					tmp = n;
-					n = j;
-				}
-			}
-			
-			if (i == 0) {
-				offset = lba % SECTORS_PER_PAGE;
-				
-				if (nsect + offset < SECTORS_PER_PAGE)
-					size = nsect * SECTOR_SIZE;
-				else 
-					size = PAGE_DATA_SIZE - offset * SECTOR_SIZE;
-
-				memcpy(buffer[n] + offset, write_buffer, size);
-				(*buffer_count)++;
-				
-				for (int j = offset ; j < offset + size / SECTOR_SIZE ; j++)
-					buffer_sector_valid[n][j] = true;
-				
-				write_buffer += size / SECTOR_SIZE;
-			} else if (i == npage - 1) {
-				offset = (lba + nsect) % SECTORS_PER_PAGE;
-				if (offset == 0) {
-					size = PAGE_DATA_SIZE;
-					memcpy(buffer[n], write_buffer, size);
-					(*buffer_count)++;
-				}
-				else {
-					size = offset * SECTOR_SIZE;
-					memcpy(buffer[n], write_buffer, size);
-					(*buffer_count)++;
-				}
-				for (int j = 0 ; j < size / SECTOR_SIZE ; j++)
-					buffer_sector_valid[n][j] = true;
-			} else {
-				size = PAGE_DATA_SIZE;
-				memcpy(buffer[n], write_buffer, size);
-				(*buffer_count)++;
-				write_buffer += SECTORS_PER_PAGE;
+/*
+ *	Bank to write a page whose map is in bank home
+ *
+ *	Only banks below WRITE_BANK_LIMIT valid pages qualify, so that GC,
+ *	which starts with N_USER_BLOCKS_PB - N_GC_BLOCKS full data blocks,
+ *	always finds a victim with invalid pages. Ties go to home, then to
+ *	the banks after it. With no bank below the limit the page goes
+ *	home, as with static striping.
+ *
+ *	FTL_WRITE_BANK_LOAD picks the bank whose queued NAND work ends
+ *	first. Without the simulated clock every bank ends at 0, so the
+ *	NAND time each bank was given so far decides instead.
+ *
+ *	FTL_WRITE_BANK_GC counts full data blocks against the bank's own
+ *	data pool, which differs per bank with ADAPTIVE_SPLIT. Raw counts
+ *	would favour a bank that gave blocks to map GC, where data GC comes
+ *	soonest.
+ */
+#define WRITE_BANK_LIMIT	((N_USER_BLOCKS_PB - N_GC_BLOCKS - 1) * PAGES_PER_BLK)
 
-				for (int j = 0 ; j < size / SECTOR_SIZE ; j++)
-					buffer_sector_valid[n][j] = true;
-			}
-			
-			int valid_count = 0;
-			for (int j = 0 ; j < SECTORS_PER_PAGE ; j++) {
-				if (buffer_sector_valid[n][j] == true)
-					valid_count++;
-			}
+static u32 select_write_bank(struct ftl_device *dev, u32 home)
+{
+	u32 best = home;
+	u64 best_cost = ~0ull, best_work = ~0ull;
 
-			buffer_list[n] = *lpn;
-			if (tmp != -1) {
-				n = tmp;
-				(*buffer_count)--;
-			}
-				
-			else 
-				n++;
+	if (dev->geo.write_bank == FTL_WRITE_BANK_HOME)
+		return home;
+
+	for (int i = 0; i < N_BANKS; i++) {
+		u32 bank = (home + i) % N_BANKS;
+		u64 cost, work = 0;
 
-			(*lpn)++;
+		if (dev->bank_valid[bank] >= WRITE_BANK_LIMIT)
+			continue;
+		if (dev->geo.write_bank == FTL_WRITE_BANK_LOAD) {
+			cost = nand_bank_free(dev->nand, bank);
+			work = nand_bank_work(dev->nand, bank);
+		} else
+			cost = count_full_data(dev, bank) + BLKS_PER_BANK - dev->split[bank].data_blocks;
+
+		if (cost < best_cost || (cost == best_cost && work < best_work)) {
+			best = bank;
+			best_cost = cost;
+			best_work = work;
 		}
-	} else {
-		write(lba, nsect, write_buffer);
-	} */
-	free(lpn);
-	free(write_data);
-	stats.host_write += nsect;
-	ref_time++;
-	return;
+	}
+	return best;
 }
 
-void write(u32 lba, u32 nsect, u32 *write_buf) 
+/*
+ *	Write pages to flash
+ *
+ *	The old copy of each page is only invalidated, not read: callers
+ *	pass whole pages, partly buffered ones merged first (exec_page_op).
+ */
+static void write(struct ftl_device *dev, u32 lba, u32 nsect, u32 *write_buf) 
 {
 	int *lpn_ = malloc(sizeof(int));
 	u32 D_ppn = 0;
 	int bank;
+	int D_bank;
 	int D_block;
 	int D_page;
 	int old_D_ppn = -1;
@@ -989,225 +3145,106 @@ void write(u32 lba, u32 nsect, u32 *write_buf)
 
 	int start_page = lba / SECTORS_PER_PAGE;
 	int npage = end_page - start_page;
-	int offset;
-	int size;
+	u32 offset;
+	u32 size;
 
 	for (int i = 0 ; i < npage; i++) {
 		memset(write_data_, -1, PAGE_DATA_SIZE);
 
 		*lpn_ = (lba / SECTORS_PER_PAGE) + i;
-		bank = *lpn_ % N_BANKS;
-
-		u32 nfull_data = 0;
-		for (int j = 0 ; j < BLKS_PER_BANK ; j++) {
-			if (blk_state[bank][j].full == true 
-				&& blk_state[bank][j].area == DATA_BLOCK) 
-			{
-				nfull_data++;
-			}
-		}
-
-		if (nfull_data == N_USER_BLOCKS_PB - N_GC_BLOCKS) {
-			garbage_collection(bank);
-		}
-
-		// data ppn
-		if (current_block_user[bank] == -1) {
-			D_block = 0;
-			while (blk_state[bank][D_block].full == true
-					|| blk_state[bank][D_block].area == TR_BLOCK) 
-			{
-				D_block++;
-			}
-			current_block_user[bank] = D_block;
+		bank = lpn_bank(&dev->geo, *lpn_);
+
+		if (dev->geo.superblock) {
+			// data ppn, next page of the open stripe
+			if (dev->sb_open == -1 && dev->sb_full >= N_USER_BLOCKS_PB - N_GC_BLOCKS)
+				sb_garbage_collection(dev);
+			D_ppn = sb_alloc_page(dev);
+			D_bank = ppn_bank(&dev->geo, D_ppn);
+			D_block = ppn_block(&dev->geo, D_ppn);
+			D_page = ppn_page(&dev->geo, D_ppn);
+			dev->sb[dev->blk_sb[D_bank][D_block]].nvalid++;
 		} else {
-			D_block = current_block_user[bank];
-		}
-
-		D_page = 0;
-		while (page_state[bank][D_block][D_page].write == true) {
-			D_page++;
-		}
-		D_ppn = (N_PPNS_PB * bank) + (PAGES_PER_BLK * D_block) + D_page;
-		blk_state[bank][D_block].area = DATA_BLOCK;
+			D_bank = select_write_bank(dev, bank);
 
-		u32 map_page = *lpn_ / (N_BANKS * N_MAP_ENTRIES_PER_PAGE);
-		u32 map_offset = *lpn_ % (N_BANKS * N_MAP_ENTRIES_PER_PAGE) / (N_BANKS);
-	 	u32 cmt_index = -1;
-
-		for (int j = 0; j < N_CACHED_MAP_PAGE_PB; j++) {
-			if (CMT[bank][j].map_page == map_page)
-				cmt_index = j;
-		}
-
-		if (cmt_index == -1) 
-		{
-			// CMT에 없을 때 (miss)
-			stats.cache_miss++;
-
-			u32 i_slot = 0;
-			u32 n_vacant_slot = 0;
-
-			// 빈 slot 개수
-			while (i_slot < N_CACHED_MAP_PAGE_PB)
-			{
-				if (CMT[bank][i_slot].valid == false)
-					n_vacant_slot++;
-				i_slot++;
+			if (count_full_data(dev, D_bank) >= dev->split[D_bank].data_blocks - N_GC_BLOCKS) {
+				garbage_collection(dev, D_bank);
 			}
 
-			if (n_vacant_slot == 0) 
-			{
-				// slot 가득 찼을 때
-
-				u32 i_min_val = CMT[bank][0].ref_time;
-				u32 i_min = 0;
-
-				for (int j = 1; j < N_CACHED_MAP_PAGE_PB; j++)
+			// data ppn
+			if (dev->current_block_user[D_bank] == -1) {
+				D_block = 0;
+				while (dev->blk_state[D_bank][D_block].full == true
+						|| dev->blk_state[D_bank][D_block].area == TR_BLOCK) 
 				{
-					if (CMT[bank][j].ref_time < i_min_val)
-					{
-						i_min = j;
-						i_min_val = CMT[bank][j].ref_time;
-					}
-				}
-
-				// dirty bit check
-				if (CMT[bank][i_min].dirty == true)
-				{
-					// map garbage collection trigger
-					u32 nfull_tr = 0;
-					for (int j = 0 ; j < BLKS_PER_BANK ; j++) {
-						if (blk_state[bank][j].full == true 
-							&& blk_state[bank][j].area == TR_BLOCK) 
-							nfull_tr++;
-					}
-
-					if (nfull_tr == N_MAP_BLOCKS_PB - N_GC_BLOCKS) {
-						map_garbage_collection(bank);
-					}
-
-					// flush
-					map_write(bank, CMT[bank][i_min].map_page, i_min);						
+					D_block++;
 				}
+				dev->current_block_user[D_bank] = D_block;
+			} else {
+				D_block = dev->current_block_user[D_bank];
+			}
 
-				init_CMT(bank, i_min);
-				
-				// load or make
-				if (GTD[bank][map_page] != -1)
-				{
-					map_read(bank, map_page, i_min);
-					old_D_ppn = CMT[bank][i_min].map_entry[map_offset];
-				}
-				else
-				{
-					old_D_ppn = CMT[bank][i_min].map_entry[map_offset];
-
-					CMT[bank][i_min].ref_time = ref_time;
-					CMT[bank][i_min].map_page = map_page;
-					CMT[bank][i_min].valid = true;
-					CMT[bank][i_min].dirty = false;
-				}		 
-				CMT[bank][i_min].map_entry[map_offset] = D_ppn;
-				CMT[bank][i_min].dirty = true;
+			D_page = 0;
+			while (dev->page_state[D_bank][D_block][D_page].write == true) {
+				D_page++;
 			}
-			else
-			{
-				// slot 빈자리 있을 때
-				u32 vacant_slot = 0;
-				i_slot = 0;
-				while (CMT[bank][i_slot].valid == true) 
-				{
-					vacant_slot++;
-					i_slot++;
-				}
+			D_ppn = to_ppn(&dev->geo, D_bank, D_block, D_page);
+			dev->blk_state[D_bank][D_block].area = DATA_BLOCK;
+		}
 
-				if (GTD[bank][map_page] != -1)
-				{
-					map_read(bank, map_page, vacant_slot);
-					old_D_ppn = CMT[bank][vacant_slot].map_entry[map_offset];
-				}
-				else
-				{
-					old_D_ppn = CMT[bank][vacant_slot].map_entry[map_offset];
+		u32 map_page = lpn_map_page(&dev->geo, *lpn_);
+		u32 map_offset = lpn_map_offset(&dev->geo, *lpn_);
+	 	u32 cmt_index = find_CMT(dev, bank, map_page);
 
-					CMT[bank][vacant_slot].ref_time = ref_time;
-					CMT[bank][vacant_slot].map_page = map_page;
-					CMT[bank][vacant_slot].map_entry[map_offset] = D_ppn;
-					CMT[bank][vacant_slot].valid = true;
-					CMT[bank][vacant_slot].dirty = true;
-				}
-			}
+		if (cmt_index == -1) 
+		{
+			// CMT에 없을 때 (miss), load or make
+			dev->bank_stats[bank].cache_miss++;
+			cmt_index = load_CMT(dev, bank, map_page);
 		} 
 		else 
 		{
-			// CMT에 있을 때 (hit)
-			stats.cache_hit++;
-
-			old_D_ppn = CMT[bank][cmt_index].map_entry[map_offset];
-
-			CMT[bank][cmt_index].ref_time = ref_time;
-			CMT[bank][cmt_index].map_page = map_page;
-			CMT[bank][cmt_index].map_entry[map_offset] = D_ppn;
-			CMT[bank][cmt_index].valid = true;
-			CMT[bank][cmt_index].dirty = true;
+			// CMT에 있을 때 (hit), the first use of a prefetched map page is a prefetch hit
+			if (dev->CMT[bank][cmt_index].prefetched == true) {
+				dev->CMT[bank][cmt_index].prefetched = false;
+				dev->bank_stats[bank].prefetch_hit++;
+			} else
+				dev->bank_stats[bank].cache_hit++;
 		}
 
+		old_D_ppn = lookup_map(&dev->CMT[bank][cmt_index].map, dev->CMT[bank][cmt_index].compressed, map_offset);
+		set_CMT(dev, bank, cmt_index, map_offset, D_ppn);
+
 		// old data invalid, load
 		if (old_D_ppn != -1)
 		{
-			u32 spare_lpn;
-			
-			old_bank = old_D_ppn / N_PPNS_PB;
-			old_block = (old_D_ppn - (N_PPNS_PB * bank)) / PAGES_PER_BLK;
-			old_page = (old_D_ppn - (N_PPNS_PB * bank)) % PAGES_PER_BLK;
-
-			page_state[old_bank][old_block][old_page].valid = false;
-			if (blk_state[old_bank][old_block].nvalid > 0)
-				blk_state[old_bank][old_block].nvalid--;
-
-			nand_read(old_bank, old_block, old_page, write_data_, &spare_lpn);
-			stats.nand_read++;
+			old_bank = ppn_bank(&dev->geo, old_D_ppn);
+			old_block = ppn_block(&dev->geo, old_D_ppn);
+			old_page = ppn_page(&dev->geo, old_D_ppn);
+
+			dev->page_state[old_bank][old_block][old_page].valid = false;
+			if (dev->blk_state[old_bank][old_block].nvalid > 0)
+				dev->blk_state[old_bank][old_block].nvalid--;
+			dev->bank_valid[old_bank]--;
+			if (dev->geo.superblock)
+				dev->sb[dev->blk_sb[old_bank][old_block]].nvalid--;
 		}
 
 		// write data page
-		if (i == 0) {
-			offset = lba % SECTORS_PER_PAGE;
-			
-			if (nsect + offset < SECTORS_PER_PAGE)
-				size = nsect * SECTOR_SIZE;
-			else 
-				size = PAGE_DATA_SIZE - offset * SECTOR_SIZE;
-			memcpy(write_data_ + offset, write_buf, size);
-			write_buf += size / SECTOR_SIZE;
-		} else if (i == npage - 1) {
-			offset = (lba + nsect) % SECTORS_PER_PAGE;
-			if (offset == 0) {
-				size = PAGE_DATA_SIZE;
-				memcpy(write_data_, write_buf, size);
-			}
-			else {
-				size = offset * SECTOR_SIZE;
-				memcpy(write_data_, write_buf, size);
-				write_buf += SECTORS_PER_PAGE;
-			}
-				
-		} else {
-			size = PAGE_DATA_SIZE;
-			memcpy(write_data_, write_buf, size);
-			write_buf += SECTORS_PER_PAGE;
-		}
+		page_range(lba, nsect, *lpn_, &offset, &size);
+		memcpy(write_data_ + offset, write_buf, size * SECTOR_SIZE);
+		write_buf += size;
 
-		nand_write(bank, D_block, D_page, write_data_, lpn_);
-		stats.nand_write++;
+		nand_write(dev->nand, D_bank, D_block, D_page, write_data_, lpn_);
+		dev->bank_stats[D_bank].nand_write++;
 
-		page_state[bank][D_block][D_page].write = true;
-		page_state[bank][D_block][D_page].valid = true;
-		(blk_state[bank][D_block].nvalid)++;
+		dev->page_state[D_bank][D_block][D_page].write = true;
+		dev->page_state[D_bank][D_block][D_page].valid = true;
+		(dev->blk_state[D_bank][D_block].nvalid)++;
+		dev->bank_valid[D_bank]++;
 
 		if (D_page == PAGES_PER_BLK - 1) {
-			blk_state[bank][D_block].full = true;
-			current_block_user[bank] = -1;
+			dev->blk_state[D_bank][D_block].full = true;
+			dev->current_block_user[D_bank] = -1;
 		}
 	}
 
@@ -1217,19 +3254,69 @@ void write(u32 lba, u32 nsect, u32 *write_buf)
 }
 
 
-void read(u32 lba, u32 nsect, u32 *read_buf)
+/*
+ *	PPN of lpn for a read through CMT, -1 if it was never written
+ *
+ *	*last_map_page and *last_index keep the CMT slot of the previous
+ *	lookup on the bank. A page of the same map page goes straight to
+ *	that slot instead of searching CMT again, and counts as a hit.
+ */
+static u32 read_lookup(struct ftl_device *dev, u32 bank, u32 lpn, u32 *last_map_page, u32 *last_index)
+{
+	u32 map_page = lpn_map_page(&dev->geo, lpn);
+	u32 map_offset = lpn_map_offset(&dev->geo, lpn);
+	u32 cmt_index;
+
+	if (map_page == *last_map_page) {
+		dev->bank_stats[bank].cache_hit++;
+		cmt_index = *last_index;
+	} else {
+		cmt_index = find_CMT(dev, bank, map_page);
+
+		if (cmt_index == -1)
+		{
+			// CMT에 없을 때 (miss)
+			dev->bank_stats[bank].cache_miss++;
+
+			if (dev->GTD[bank][map_page] != -1)
+			{
+				// NAND에 있을 때, load to CMT
+				cmt_index = load_CMT(dev, bank, map_page);
+				prefetch_map(dev, bank, map_page, cmt_index);
+			}
+		}
+		else
+		{
+			// CMT에 있을 때 (hit)
+			// prefetched map page used, count it apart and keep the stream ahead
+			if (dev->CMT[bank][cmt_index].prefetched == true) {
+				dev->CMT[bank][cmt_index].prefetched = false;
+				dev->bank_stats[bank].prefetch_hit++;
+				prefetch_map(dev, bank, map_page, cmt_index);
+			} else
+				dev->bank_stats[bank].cache_hit++;
+		}
+
+		*last_map_page = cmt_index != -1 ? map_page : -1;
+		*last_index = cmt_index;
+	}
+
+	if (cmt_index == -1)
+		return -1;
+	return lookup_map(&dev->CMT[bank][cmt_index].map, dev->CMT[bank][cmt_index].compressed, map_offset);
+}
+
+static void read(struct ftl_device *dev, u32 lba, u32 nsect, u32 *read_buf)
 {	
 	int bank;
 	int D_bank;
 	int D_block;
 	int D_page;
-	int M_bank;
-	int M_block;
-	int M_page;
 	u32 offset;
 	u32 size;
 	u32 D_ppn = 0;
-	u32 M_ppn = 0;
+	u32 last_map_page = -1;
+	u32 last_index = -1;
 	u32 *read_data_ = malloc(PAGE_DATA_SIZE);
 	int *lpn_ = malloc(sizeof(int));
 	
@@ -1243,167 +3330,59 @@ void read(u32 lba, u32 nsect, u32 *read_buf)
 	for (int i = 0 ; i < npage; i++) {
 	
 		*lpn_ = (lba / SECTORS_PER_PAGE) + i;
-		bank = *lpn_ % N_BANKS;
-
-		u32 map_page = *lpn_ / (N_BANKS * N_MAP_ENTRIES_PER_PAGE);
-		u32 map_offset = *lpn_ % (N_BANKS * N_MAP_ENTRIES_PER_PAGE) / (N_BANKS);
-	 	u32 cmt_index = -1;
-		for (int j = 0; j < N_CACHED_MAP_PAGE_PB; j++) {
-			if (CMT[bank][j].map_page == map_page)
-				cmt_index = j;
-		}
+		bank = lpn_bank(&dev->geo, *lpn_);
 
 		memset(read_data_, -1, SECTOR_SIZE * SECTORS_PER_PAGE);
 
-		if (cmt_index == -1) 
-		{
-			// CMT에 없을 때 (miss)
-			stats.cache_miss++;
-
-			if (GTD[bank][map_page] == -1)
-			{
-				// NAND에 없을 때
-				memset(read_data_, -1, SECTOR_SIZE * SECTORS_PER_PAGE);
-			}
-			else
-			{
-				// NAND에 있을 때
-				u32 spare_lpn;
-				M_ppn = GTD[bank][map_page];
-				
-				M_bank = M_ppn / N_PPNS_PB;
-				M_block = (M_ppn - (N_PPNS_PB * bank)) / PAGES_PER_BLK;
-				M_page = (M_ppn - (N_PPNS_PB * bank)) % PAGES_PER_BLK;		
-
-				u32 *read_data_map = malloc(PAGE_DATA_SIZE);
-				memset(read_data_map, -1, SECTOR_SIZE * SECTORS_PER_PAGE);
-
-				nand_read(M_bank, M_block, M_page, read_data_map, &spare_lpn);
-				stats.nand_read++;
-
-				D_ppn = read_data_map[map_offset];
-				free(read_data_map);
-
-				D_bank = D_ppn / N_PPNS_PB;
-				D_block = (D_ppn - (N_PPNS_PB * bank)) / PAGES_PER_BLK;
-				D_page = (D_ppn - (N_PPNS_PB * bank)) % PAGES_PER_BLK;
-				nand_read(D_bank, D_block, D_page, read_data_, &spare_lpn);
-				stats.nand_read++;
+		last_map_page = -1;
+		D_ppn = read_lookup(dev, bank, *lpn_, &last_map_page, &last_index);
 
-				// CMT update
-
-				u32 i_slot = 0;
-				u32 n_vacant_slot = 0;
-
-				// 빈 slot 개수
-				while (i_slot < N_CACHED_MAP_PAGE_PB)
-				{
-					if (CMT[bank][i_slot].valid == false)
-						n_vacant_slot++;
-					i_slot++;
-				}
-
-
-				if (n_vacant_slot == 0) 
-				{
-					// slot 가득 찼을 때
-
-					u32 i_min_val = CMT[bank][0].ref_time;
-					u32 i_min = 0;
-
-					for (int j = 1; j < N_CACHED_MAP_PAGE_PB; j++)
-					{
-						if (CMT[bank][j].ref_time < i_min_val)
-						{
-							i_min = j;
-							i_min_val = CMT[bank][j].ref_time;
-						}
-					}
-
-					// dirty bit check
-					if (CMT[bank][i_min].dirty == true)
-					{
-						// map garbage collection trigger
-						u32 nfull_tr = 0;
-						for (int j = 0 ; j < BLKS_PER_BANK ; j++) {
-							if (blk_state[bank][j].full == true 
-								&& blk_state[bank][j].area == TR_BLOCK) 
-								nfull_tr++;
-						}
-
-						if (nfull_tr == N_MAP_BLOCKS_PB - N_GC_BLOCKS) {
-							map_garbage_collection(bank);
-						}
-
-						// flush
-						map_write(bank, CMT[bank][i_min].map_page, i_min);					
-					}
-
-					// load or make
-					map_read(bank, map_page, i_min);
-				}
-				else
-				{
-					// slot 빈자리 있을 때
-					u32 vacant_slot = 0;
-					i_slot = 0;
-					while (CMT[bank][i_slot].valid == true) 
-					{
-						vacant_slot++;
-						i_slot++;
-					}
-					map_read(bank, map_page, vacant_slot);
-				}
-			}
-		}
-		else
+		if (D_ppn != -1)
 		{
-			// CMT에 있을 때 (hit)
-			D_ppn = CMT[bank][cmt_index].map_entry[map_offset];
-			
-			if (D_ppn == -1)
-			{
-				memset(read_data_, -1, SECTOR_SIZE * SECTORS_PER_PAGE);
-			}
-			
 			u32 spare_lpn;
 
-			D_bank = D_ppn / N_PPNS_PB;
-			D_block = (D_ppn - (N_PPNS_PB * bank)) / PAGES_PER_BLK;
-			D_page = (D_ppn - (N_PPNS_PB * bank)) % PAGES_PER_BLK;
+			D_bank = ppn_bank(&dev->geo, D_ppn);
+			D_block = ppn_block(&dev->geo, D_ppn);
+			D_page = ppn_page(&dev->geo, D_ppn);
 
-			nand_read(D_bank, D_block, D_page, read_data_, &spare_lpn);
-			stats.nand_read++;
-			stats.cache_hit++;
+			nand_read(dev->nand, D_bank, D_block, D_page, read_data_, &spare_lpn);
+			dev->bank_stats[bank].nand_read++;
 		}
 
-		if (i == 0) {
-			offset = lba % SECTORS_PER_PAGE;
-			if (nsect + offset < SECTORS_PER_PAGE)
-				size = nsect * SECTOR_SIZE;
-			else
-				size = PAGE_DATA_SIZE - offset * SECTOR_SIZE;
-			memcpy(read_buf, read_data_ + offset, size);
-			read_buf += size / SECTOR_SIZE;
-		} else if (i == npage - 1) {
-			offset = (lba + nsect) % SECTORS_PER_PAGE;
-			if (offset == 0)
-				size = PAGE_DATA_SIZE;
-			else
-				size = offset * SECTOR_SIZE;
-			memcpy(read_buf, read_data_, size);
-			read_buf += size / SECTOR_SIZE;
-		} else {
-			size = PAGE_DATA_SIZE;
-			memcpy(read_buf, read_data_, size);
-			read_buf += SECTORS_PER_PAGE;
-		}
+		page_range(lba, nsect, *lpn_, &offset, &size);
+		memcpy(read_buf, read_data_ + offset, size * SECTOR_SIZE);
+		read_buf += size;
 	}
-	read_buf -= nsect;
 
 	free(read_data_);
 	free(lpn_);
-	stats.host_read += nsect;
 	return;
 }
 
+/*
+ *	Read the flash pages of a host read that are on one bank
+ *
+ *	op->batch comes sorted by map page, so each map page is found in
+ *	or loaded to CMT once, and the NAND reads follow back to back.
+ *	Page batch[k].slot of the request goes to out + slot pages.
+ */
+static void read_batch(struct ftl_device *dev, u32 bank, const PAGE_OP *op)
+{
+	u32 last_map_page = -1;
+	u32 last_index = -1;
+
+	for (u32 k = 0; k < op->n; k++) {
+		u32 *out = op->out + (size_t)op->batch[k].slot * SECTORS_PER_PAGE;
+		u32 ppn = read_lookup(dev, bank, op->batch[k].lpn, &last_map_page, &last_index);
+		u32 spare_lpn;
+
+		if (ppn == -1) {
+			memset(out, -1, PAGE_DATA_SIZE);
+			continue;
+		}
+		nand_read(dev->nand, ppn_bank(&dev->geo, ppn), ppn_block(&dev->geo, ppn), ppn_page(&dev->geo, ppn),
+				  out, &spare_lpn);
+		dev->bank_stats[bank].nand_read++;
+	}
+}
+
@@ -17,26 +17,122 @@
 
 //#define NO_CACHE
 typedef unsigned int 		u32;
+typedef unsigned long long	u64;
 
-#define SECTOR_SIZE					sizeof(u32)
-#define N_BANKS						8
-#define BLKS_PER_BANK				40
-#define PAGES_PER_BLK				16
-#define SECTORS_PER_PAGE			(PAGE_DATA_SIZE / sizeof(u32))
+/*
+ * Divisor for address math, see ftl_addr.h
+ * shift >= 0 if d is a power of two, magic is for the other case.
+ */
+struct ftl_divisor {
+	u32 d;
+	int shift;
+	u64 magic;
+};
+
+/*
+ * Device geometry
+ *
+ * Set at run time (ftl_set_param / ftl_load_config) and passed to
+ * ftl_open, each device keeps its own copy. ftl1.h ... ftl8.h are
+ * geometry presets that can be loaded as config files. The derived
+ * fields are filled in by ftl_check_geometry.
+ *
+ * Building with -DFTL_GEOMETRY='"ftl8.h"' fixes the geometry to that
+ * preset instead, so all address math is on compile-time constants.
+ */
+struct ftl_geometry {
+	int n_banks;
+	int blks_per_bank;
+	int pages_per_blk;
+	int op_ratio;
+	int cmt_ratio;
+	int n_buffers;
+	int n_workers;		// bank worker threads, 0 runs banks on the caller
+	int t_read;			// NAND latency in us, see ftl_timed_read
+	int t_prog;
+	int t_erase;
+	int t_xfer;			// page transfer on a channel in us
+	int n_channels;		// bank b is on channel b % n_channels, 0 for one per bank
+	int interleave;		// LPN to bank function, FTL_INTERLEAVE_*
+	int interleave_chunk;	// pages per bank for FTL_INTERLEAVE_CHUNK, 0 for a block
+	int write_bank;		// where page writes go, FTL_WRITE_BANK_*
+	int superblock;		// 1 writes and collects stripes of one block per bank
+	int adaptive_split;	// 1 moves OP blocks between the data and map pools
+	int buffer_policy;	// write buffer eviction, FTL_BUFFER_*
+	int flush_watermark;	// % of N_BUFFERS that starts a batch flush, 0 for none
+	int flush_batch;	// pages per batch flush, 0 for one map page per bank
+	int read_cache;		// pages of clean read cache, 0 for none
+	int adaptive_dram;	// 1 moves DRAM between write buffer, read cache and CMT
+	int bypass_sectors;	// sectors of a write or sequential run that skip the buffer, 0 for none
+	int drain_watermark;	// % of the buffer idle banks drain it down to, 0 for none
 
-#define OP_RATIO					7
+	/* derived */
+	int n_ways;			// banks per channel
+	int n_ppns_pb;
+	int n_map_pages_pb;
+	int n_map_blocks_pb;
+	int n_user_blocks_pb;
+	int n_op_blocks_pb;
+	int cmt_size_pb;
+	int n_cached_map_page_pb;
+
+	struct ftl_divisor div_banks;
+	struct ftl_divisor div_blks;
+	struct ftl_divisor div_pages;
+	struct ftl_divisor div_chunk;
+};
 
-#define N_BUFFERS					(10)
-#define BUFFER_SIZE					(N_BUFFERS*SECTORS_PER_PAGE*SECTOR_SIZE)
+/*
+ * LPN to bank interleaving, see lpn_bank in ftl_addr.h
+ */
+#define FTL_INTERLEAVE_PAGE		0	// lpn % N_BANKS
+#define FTL_INTERLEAVE_CHUNK	1	// runs of interleave_chunk pages per bank
+#define FTL_INTERLEAVE_HASH		2	// each stripe rotated by a hash of its index
+
+/*
+ * Write bank selection
+ *
+ * The map of an LPN always stays in its home bank (lpn_bank), the data
+ * page may be written to another bank and the map points across.
+ */
+#define FTL_WRITE_BANK_HOME		0	// the home bank
+#define FTL_WRITE_BANK_LOAD		1	// the bank that is free first (simulated time)
+#define FTL_WRITE_BANK_GC		2	// the bank with the fewest full data blocks
+
+/*
+ * Write buffer eviction
+ */
+#define FTL_BUFFER_FIFO			0	// the oldest buffered page
+#define FTL_BUFFER_LRU			1	// the least recently written page
+#define FTL_BUFFER_BLOCK		2	// LRU, with the rest of its logical block
+
+extern const struct ftl_geometry ftl_default_geometry;
+
+/*
+ * The geometry macros below read FTL_GEO. By default that is *geo,
+ * a struct ftl_geometry pointer in the caller's scope; ftl.c points
+ * it at the device handle instead.
+ */
+#ifndef FTL_GEO
+#define FTL_GEO						(*geo)
+#endif
+
+#define BUFFER_SIZE					(N_BUFFERS * SECTORS_PER_PAGE * SECTOR_SIZE)
+
+#define SECTOR_SIZE					sizeof(u32)
+#define SECTORS_PER_PAGE			(PAGE_DATA_SIZE / sizeof(u32))
 
 #define MAP_ENTRY_SIZE				(sizeof(u32))
 #define N_MAP_ENTRIES_PER_PAGE		(PAGE_DATA_SIZE / MAP_ENTRY_SIZE)
 
+#ifdef FTL_GEOMETRY
+
+#include FTL_GEOMETRY
+
 /* Per Bank */
-#define CMT_RATIO					5
-#define CMT_SIZE_PB					(BLKS_PER_BANK * PAGES_PER_BLK * sizeof(u32) * CMT_RATIO / 100) // 5% of total map table
+#define CMT_SIZE_PB					(BLKS_PER_BANK * PAGES_PER_BLK * sizeof(u32) * CMT_RATIO / 100) // CMT_RATIO % of total map table
 
-#define N_CACHED_MAP_PAGE_PB_TEMP	((const int)(CMT_SIZE_PB / (MAP_ENTRY_SIZE * N_MAP_ENTRIES_PER_PAGE)))
+#define N_CACHED_MAP_PAGE_PB_TEMP	((int)(CMT_SIZE_PB / (MAP_ENTRY_SIZE * N_MAP_ENTRIES_PER_PAGE)))
 #define N_CACHED_MAP_PAGE_PB		((0<N_CACHED_MAP_PAGE_PB_TEMP)?(N_CACHED_MAP_PAGE_PB_TEMP):(1))
 
 #define N_PPNS_PB					(BLKS_PER_BANK * PAGES_PER_BLK)
@@ -46,6 +142,33 @@ typedef unsigned int 		u32;
 #define N_USER_BLOCKS_PB			(((BLKS_PER_BANK - N_MAP_BLOCKS_PB) * 100) / (100 + OP_RATIO))
 #define N_OP_BLOCKS_PB				(BLKS_PER_BANK - N_MAP_BLOCKS_PB - N_USER_BLOCKS_PB)
 
+#else
+
+#define N_BUFFERS					(FTL_GEO.n_buffers)
+
+#define N_BANKS						(FTL_GEO.n_banks)
+#define BLKS_PER_BANK				(FTL_GEO.blks_per_bank)
+#define PAGES_PER_BLK				(FTL_GEO.pages_per_blk)
+
+#define OP_RATIO					(FTL_GEO.op_ratio)
+
+/* Per Bank */
+#define CMT_RATIO					(FTL_GEO.cmt_ratio)
+#define CMT_SIZE_PB					(FTL_GEO.cmt_size_pb) // CMT_RATIO % of total map table
+
+#define N_CACHED_MAP_PAGE_PB		(FTL_GEO.n_cached_map_page_pb)
+
+#define N_PPNS_PB					(FTL_GEO.n_ppns_pb)
+#define N_MAP_PAGES_PB				(FTL_GEO.n_map_pages_pb)
+
+#define N_MAP_BLOCKS_PB				(FTL_GEO.n_map_blocks_pb)
+#define N_USER_BLOCKS_PB			(FTL_GEO.n_user_blocks_pb)
+#define N_OP_BLOCKS_PB				(FTL_GEO.n_op_blocks_pb)
+
+#endif
+
+#define N_GC_BLOCKS					1
+
 #define MAP_OP_RATIO				(0.4)
 #define USER_OP_RATIO				(0.6)
 
@@ -76,10 +199,96 @@ struct ftl_stats {
 	long map_gc_write, map_gc_read;
 	long cache_hit;
 	long cache_miss;
+	long prefetch_read, prefetch_hit, prefetch_waste;	// prefetch_hit: first use, not in cache_hit
+	long read_cache_hit, read_cache_miss;	// pages of host reads
+	long buffer_hit, buffer_miss;			// pages of buffered host writes
+	long bypass_write;						// pages written around the buffer
+	int cmt_max_cached;
+	double bank_imbalance;		// NAND ops of the busiest bank over the mean
+	double gc_time;				// wall clock seconds in data GC
+	double gc_time_max;			// longest GC
+};
+
+/* FTL instance, owns its NAND and all mapping state */
+struct ftl_device;
+
+/*
+ * Asynchronous queue pair
+ *
+ * Commands are submitted with a tag and complete later, in any order,
+ * with the same tag. A queue pair holds at most its depth of commands
+ * between ftl_submit and the ftl_poll that returns them; buf must stay
+ * untouched until then. One thread uses a queue pair, several queue
+ * pairs of a device may be used from different threads.
+ */
+struct ftl_qpair;
+
+#define FTL_CMD_READ		0
+#define FTL_CMD_WRITE		1
+#define FTL_CMD_FLUSH		2	// all buffered data to flash, lba / nsect / buf unused
+
+/* flags */
+#define FTL_CMD_FUA			0x1	// write completes once its pages are on flash
+
+struct ftl_cmd {
+	u32 opcode;
+	u32 tag;
+	u32 lba;
+	u32 nsect;
+	u32 *buf;
+	u32 flags;
+};
+
+struct ftl_cpl {
+	u32 tag;
+	int status;
 };
 
-extern struct ftl_stats stats;
+/* return code */
+#define FTL_SUCCESS			0
+#define FTL_ERR_INVALID		-1
+#define FTL_ERR_BUSY		-2	// queue pair is full
+
+/*
+ * Data / map block split of a bank, see ftl_get_split_history
+ */
+struct ftl_split_sample {
+	long host_pages;	// pages the bank had written for the host
+	int data_blocks;
+	int map_blocks;
+};
+
+/*
+ * DRAM split between write buffer, read cache and CMT, see
+ * ftl_get_dram_history. CMT pages are PAGE_DATA_SIZE bytes of budget.
+ */
+struct ftl_dram_sample {
+	long host_cmds;		// host reads and writes so far
+	int buffer_pages;
+	int read_cache_pages;
+	int cmt_pages;		// all banks
+};
 
-void ftl_open();
-void ftl_write(u32 lba, u32 num_sectors, u32 *write_buffer);
-void ftl_read(u32 lba, u32 num_sectors, u32 *read_buffer);
\ No newline at end of file
+int ftl_set_param(struct ftl_geometry *geo, const char *name, const char *value);
+int ftl_get_param(const struct ftl_geometry *geo, const char *name, int *value);
+int ftl_load_config(struct ftl_geometry *geo, const char *path);
+int ftl_check_geometry(struct ftl_geometry *geo);
+int ftl_open(struct ftl_device **dev, const struct ftl_geometry *geo);
+void ftl_close(struct ftl_device *dev);
+void ftl_write(struct ftl_device *dev, u32 lba, u32 num_sectors, u32 *write_buffer);
+void ftl_read(struct ftl_device *dev, u32 lba, u32 num_sectors, u32 *read_buffer);
+void ftl_flush(struct ftl_device *dev);
+const struct ftl_geometry *ftl_get_geometry(const struct ftl_device *dev);
+const struct ftl_stats *ftl_get_stats(struct ftl_device *dev);
+unsigned long long ftl_timed_read(struct ftl_device *dev, unsigned long long now, u32 lba, u32 num_sectors, u32 *read_buffer);
+unsigned long long ftl_timed_write(struct ftl_device *dev, unsigned long long now, u32 lba, u32 num_sectors, u32 *write_buffer);
+unsigned long long ftl_timed_flush(struct ftl_device *dev, unsigned long long now);
+unsigned long long ftl_bank_busy(struct ftl_device *dev, int bank);
+unsigned long long ftl_channel_busy(struct ftl_device *dev, int channel);
+int ftl_qpair_create(struct ftl_device *dev, struct ftl_qpair **qp, int depth);
+void ftl_qpair_destroy(struct ftl_qpair *qp);
+int ftl_submit(struct ftl_qpair *qp, const struct ftl_cmd *cmd);
+int ftl_poll(struct ftl_qpair *qp, struct ftl_cpl *cpl, int max);
+void ftl_qpair_wait(struct ftl_qpair *qp);
+int ftl_get_split_history(struct ftl_device *dev, int bank, const struct ftl_split_sample **samples);
+int ftl_get_dram_history(struct ftl_device *dev, const struct ftl_dram_sample **samples);
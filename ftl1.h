@@ -0,0 +1,13 @@
+/*
+ * Geometry preset
+ *
+ * Load with "config=ftl1.h" on the ftl_test command line.
+ */
+#pragma once
+
+#define N_BANKS						8
+#define BLKS_PER_BANK				40
+#define PAGES_PER_BLK				16
+#define OP_RATIO					7
+#define CMT_RATIO					5
+#define N_BUFFERS					10
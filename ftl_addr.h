@@ -0,0 +1,162 @@
+/*
+ * Project1 : Custom DFTL Simulator
+ *  - Embedded Systems Design, ICE3028 (Fall, 2022)
+ *
+ * LPN / PPN address math
+ *
+ * LPNs are striped over banks by geo->interleave. Each bank numbers
+ * its own LPNs 0, 1, ... in LPN order (lpn_bank_index) and keeps them
+ * in its own map pages of N_MAP_ENTRIES_PER_PAGE entries.
+ * PPN = (N_PPNS_PB * bank) + (PAGES_PER_BLK * block) + page.
+ *
+ * With FTL_GEOMETRY every divisor is a compile-time constant and the
+ * compiler turns the math into shifts / masks or multiplies. Otherwise
+ * the divisors in geo are used: shift and mask for powers of two,
+ * precomputed reciprocal (Lemire fastdiv / fastmod) for the others.
+ */
+#pragma once
+
+#include "ftl.h"
+
+static inline void ftl_divisor_init(struct ftl_divisor *v, u32 d)
+{
+	v->d = d;
+	v->shift = -1;
+	v->magic = 0;
+
+	if ((d & (d - 1)) == 0) {
+		v->shift = 0;
+		while ((1u << v->shift) != d)
+			v->shift++;
+	} else {
+		v->magic = 0xFFFFFFFFFFFFFFFFull / d + 1;
+	}
+}
+
+static inline u32 ftl_div(const struct ftl_divisor *v, u32 x)
+{
+	if (v->shift >= 0)
+		return x >> v->shift;
+	return (u32)(((unsigned __int128)v->magic * x) >> 64);
+}
+
+static inline u32 ftl_mod(const struct ftl_divisor *v, u32 x)
+{
+	if (v->shift >= 0)
+		return x & (v->d - 1);
+	return (u32)(((unsigned __int128)(v->magic * x) * v->d) >> 64);
+}
+
+#ifdef FTL_GEOMETRY
+#define DIV_BANKS(geo, x)		((x) / N_BANKS)
+#define MOD_BANKS(geo, x)		((x) % N_BANKS)
+#define DIV_BLKS(geo, x)		((x) / BLKS_PER_BANK)
+#define MOD_BLKS(geo, x)		((x) % BLKS_PER_BANK)
+#define DIV_PAGES(geo, x)		((x) / PAGES_PER_BLK)
+#define MOD_PAGES(geo, x)		((x) % PAGES_PER_BLK)
+#define GEO_PPNS_PB(geo)		N_PPNS_PB
+#define GEO_PAGES(geo)			PAGES_PER_BLK
+#define BANKS_POW2(geo)			((N_BANKS & (N_BANKS - 1)) == 0)
+#else
+#define DIV_BANKS(geo, x)		ftl_div(&(geo)->div_banks, (x))
+#define MOD_BANKS(geo, x)		ftl_mod(&(geo)->div_banks, (x))
+#define DIV_BLKS(geo, x)		ftl_div(&(geo)->div_blks, (x))
+#define MOD_BLKS(geo, x)		ftl_mod(&(geo)->div_blks, (x))
+#define DIV_PAGES(geo, x)		ftl_div(&(geo)->div_pages, (x))
+#define MOD_PAGES(geo, x)		ftl_mod(&(geo)->div_pages, (x))
+#define GEO_PPNS_PB(geo)		((geo)->n_ppns_pb)
+#define GEO_PAGES(geo)			((geo)->pages_per_blk)
+#define BANKS_POW2(geo)			((geo)->div_banks.shift >= 0)
+#endif
+
+/*
+ * Interleaving
+ *
+ * PAGE: lpn % N_BANKS.
+ * CHUNK: runs of interleave_chunk LPNs go to one bank, the runs are
+ *   striped over the banks.
+ * HASH: each stripe of N_BANKS LPNs is permuted by a hash of its
+ *   index (XOR for a power-of-two bank count, rotation otherwise), so
+ *   strides that are multiples of N_BANKS no longer hit one bank.
+ *
+ * Every function gives each bank N_LPNS_PB LPNs.
+ */
+static inline u32 stripe_hash(u32 stripe)
+{
+	return (stripe * 2654435761u) >> 16;
+}
+
+static inline u32 lpn_bank(const struct ftl_geometry *geo, u32 lpn)
+{
+	u32 h;
+
+	switch (geo->interleave) {
+	case FTL_INTERLEAVE_CHUNK:
+		return MOD_BANKS(geo, ftl_div(&geo->div_chunk, lpn));
+	case FTL_INTERLEAVE_HASH:
+		h = MOD_BANKS(geo, stripe_hash(DIV_BANKS(geo, lpn)));
+		if (BANKS_POW2(geo))
+			return MOD_BANKS(geo, lpn) ^ h;
+		return MOD_BANKS(geo, MOD_BANKS(geo, lpn) + h);
+	default:
+		return MOD_BANKS(geo, lpn);
+	}
+}
+
+/* index of an LPN among the LPNs of its bank */
+static inline u32 lpn_bank_index(const struct ftl_geometry *geo, u32 lpn)
+{
+	if (geo->interleave == FTL_INTERLEAVE_CHUNK)
+		return DIV_BANKS(geo, ftl_div(&geo->div_chunk, lpn)) * geo->interleave_chunk +
+			   ftl_mod(&geo->div_chunk, lpn);
+	return DIV_BANKS(geo, lpn);
+}
+
+/* LPN with the given bank and index in it, inverse of lpn_bank / lpn_bank_index */
+static inline u32 bank_index_lpn(const struct ftl_geometry *geo, u32 bank, u32 index)
+{
+	u32 h;
+
+	switch (geo->interleave) {
+	case FTL_INTERLEAVE_CHUNK:
+		return (ftl_div(&geo->div_chunk, index) * geo->n_banks + bank) * geo->interleave_chunk +
+			   ftl_mod(&geo->div_chunk, index);
+	case FTL_INTERLEAVE_HASH:
+		h = MOD_BANKS(geo, stripe_hash(index));
+		if (BANKS_POW2(geo))
+			return index * geo->n_banks + (bank ^ h);
+		return index * geo->n_banks + MOD_BANKS(geo, bank + geo->n_banks - h);
+	default:
+		return index * geo->n_banks + bank;
+	}
+}
+
+static inline u32 lpn_map_page(const struct ftl_geometry *geo, u32 lpn)
+{
+	return lpn_bank_index(geo, lpn) / N_MAP_ENTRIES_PER_PAGE;
+}
+
+static inline u32 lpn_map_offset(const struct ftl_geometry *geo, u32 lpn)
+{
+	return lpn_bank_index(geo, lpn) % N_MAP_ENTRIES_PER_PAGE;
+}
+
+static inline u32 ppn_bank(const struct ftl_geometry *geo, u32 ppn)
+{
+	return DIV_BLKS(geo, DIV_PAGES(geo, ppn));
+}
+
+static inline u32 ppn_block(const struct ftl_geometry *geo, u32 ppn)
+{
+	return MOD_BLKS(geo, DIV_PAGES(geo, ppn));
+}
+
+static inline u32 ppn_page(const struct ftl_geometry *geo, u32 ppn)
+{
+	return MOD_PAGES(geo, ppn);
+}
+
+static inline u32 to_ppn(const struct ftl_geometry *geo, u32 bank, u32 block, u32 page)
+{
+	return (GEO_PPNS_PB(geo) * bank) + (GEO_PAGES(geo) * block) + page;
+}
@@ -0,0 +1,249 @@
+/*
+ * Project1 : Custom DFTL Simulator
+ *  - Embedded Systems Design, ICE3028 (Fall, 2022)
+ *
+ * Run-time device geometry
+ */
+
+#include "ftl.h"
+#include "ftl_addr.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef FTL_GEOMETRY
+/* geometry fixed at build time */
+const struct ftl_geometry ftl_default_geometry = {
+	.n_banks = N_BANKS,
+	.blks_per_bank = BLKS_PER_BANK,
+	.pages_per_blk = PAGES_PER_BLK,
+	.op_ratio = OP_RATIO,
+	.cmt_ratio = CMT_RATIO,
+	.n_buffers = N_BUFFERS,
+	.t_read = 50,
+	.t_prog = 500,
+	.t_erase = 3000,
+	.t_xfer = 10,
+};
+#else
+/* default geometry (ftl3.h) */
+const struct ftl_geometry ftl_default_geometry = {
+	.n_banks = 2,
+	.blks_per_bank = 24,
+	.pages_per_blk = 8,
+	.op_ratio = 7,
+	.cmt_ratio = 5,
+	.n_buffers = 10,
+	.t_read = 50,
+	.t_prog = 500,
+	.t_erase = 3000,
+	.t_xfer = 10,
+};
+#endif
+
+static const struct {
+	const char *name;
+	size_t offset;
+	bool geometry;		// part of the FTL_GEOMETRY preset
+} params[] = {
+	{ "N_BANKS",		offsetof(struct ftl_geometry, n_banks),			true },
+	{ "BLKS_PER_BANK",	offsetof(struct ftl_geometry, blks_per_bank),	true },
+	{ "PAGES_PER_BLK",	offsetof(struct ftl_geometry, pages_per_blk),	true },
+	{ "OP_RATIO",		offsetof(struct ftl_geometry, op_ratio),		true },
+	{ "CMT_RATIO",		offsetof(struct ftl_geometry, cmt_ratio),		true },
+	{ "N_BUFFERS",		offsetof(struct ftl_geometry, n_buffers),		true },
+	{ "N_WORKERS",		offsetof(struct ftl_geometry, n_workers),		false },
+	{ "T_READ",			offsetof(struct ftl_geometry, t_read),			false },
+	{ "T_PROG",			offsetof(struct ftl_geometry, t_prog),			false },
+	{ "T_ERASE",		offsetof(struct ftl_geometry, t_erase),			false },
+	{ "T_XFER",			offsetof(struct ftl_geometry, t_xfer),			false },
+	{ "N_CHANNELS",		offsetof(struct ftl_geometry, n_channels),		false },
+	{ "INTERLEAVE",		offsetof(struct ftl_geometry, interleave),		false },
+	{ "INTERLEAVE_CHUNK",	offsetof(struct ftl_geometry, interleave_chunk),	false },
+	{ "WRITE_BANK",		offsetof(struct ftl_geometry, write_bank),		false },
+	{ "SUPERBLOCK",		offsetof(struct ftl_geometry, superblock),		false },
+	{ "ADAPTIVE_SPLIT",	offsetof(struct ftl_geometry, adaptive_split),	false },
+	{ "BUFFER_POLICY",	offsetof(struct ftl_geometry, buffer_policy),	false },
+	{ "FLUSH_WATERMARK",	offsetof(struct ftl_geometry, flush_watermark),	false },
+	{ "FLUSH_BATCH",	offsetof(struct ftl_geometry, flush_batch),		false },
+	{ "READ_CACHE",		offsetof(struct ftl_geometry, read_cache),		false },
+	{ "ADAPTIVE_DRAM",	offsetof(struct ftl_geometry, adaptive_dram),	false },
+	{ "BYPASS_SECTORS",	offsetof(struct ftl_geometry, bypass_sectors),	false },
+	{ "DRAIN_WATERMARK",	offsetof(struct ftl_geometry, drain_watermark),	false },
+};
+
+#define N_PARAMS (sizeof(params) / sizeof(params[0]))
+#define PARAM(geo, i) ((int *)((char *)(geo) + params[i].offset))
+
+/*
+ * set one geometry parameter by its macro name
+ *
+ * With FTL_GEOMETRY the geometry is fixed, so only the built-in
+ * value is accepted for those parameters.
+ *
+ * Returns:
+ *   0 on success
+ *   FTL_ERR_INVALID if name is unknown or value is not a number
+ */
+int ftl_set_param(struct ftl_geometry *geo, const char *name, const char *value)
+{
+	char *end;
+	long v = strtol(value, &end, 0);
+
+	if (end == value || *end != '\0')
+		return FTL_ERR_INVALID;
+
+	for (int i = 0; i < N_PARAMS; i++) {
+		if (strcmp(params[i].name, name) == 0) {
+#ifdef FTL_GEOMETRY
+			if (params[i].geometry && *PARAM(&ftl_default_geometry, i) != (int)v) {
+				fprintf(stderr, "%s is fixed to %d in this build\n", name, *PARAM(&ftl_default_geometry, i));
+				return FTL_ERR_INVALID;
+			}
+#endif
+			*PARAM(geo, i) = (int)v;
+			return FTL_SUCCESS;
+		}
+	}
+	return FTL_ERR_INVALID;
+}
+
+/*
+ * get one geometry parameter by its macro name
+ *
+ * Returns:
+ *   0 on success
+ *   FTL_ERR_INVALID if name is unknown
+ */
+int ftl_get_param(const struct ftl_geometry *geo, const char *name, int *value)
+{
+	for (int i = 0; i < N_PARAMS; i++) {
+		if (strcmp(params[i].name, name) == 0) {
+			*value = *PARAM(geo, i);
+			return FTL_SUCCESS;
+		}
+	}
+	return FTL_ERR_INVALID;
+}
+
+/*
+ * load geometry parameters from a config file
+ *
+ * Each line is "NAME value", "NAME = value" or "#define NAME value",
+ * so the ftl*.h geometry presets can be loaded as they are.
+ * Comments and other preprocessor lines are skipped.
+ *
+ * Returns:
+ *   0 on success
+ *   FTL_ERR_INVALID if the file can not be read or has a bad line
+ */
+int ftl_load_config(struct ftl_geometry *geo, const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	char line[256];
+	char name[64];
+	char value[64];
+	int lineno = 0;
+
+	if (!fp)
+		return FTL_ERR_INVALID;
+
+	while (fgets(line, sizeof(line), fp)) {
+		char *p = line;
+		lineno++;
+
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '\0' || *p == '\n' || *p == '*' || !strncmp(p, "/*", 2) || !strncmp(p, "//", 2))
+			continue;
+
+		if (*p == '#') {
+			if (sscanf(p, "#define %63s %63s", name, value) != 2)
+				continue;
+		} else if (sscanf(p, "%63[A-Za-z0-9_] = %63s", name, value) != 2 &&
+				   sscanf(p, "%63s %63s", name, value) != 2) {
+			fprintf(stderr, "%s:%d: bad line\n", path, lineno);
+			fclose(fp);
+			return FTL_ERR_INVALID;
+		}
+
+		if (ftl_set_param(geo, name, value) != FTL_SUCCESS) {
+			fprintf(stderr, "%s:%d: bad parameter %s %s\n", path, lineno, name, value);
+			fclose(fp);
+			return FTL_ERR_INVALID;
+		}
+	}
+
+	fclose(fp);
+	return FTL_SUCCESS;
+}
+
+/*
+ * fill in the derived geometry and check that it is usable
+ *
+ * Returns:
+ *   0 on success
+ *   FTL_ERR_INVALID if the geometry can not run the FTL
+ */
+int ftl_check_geometry(struct ftl_geometry *geo)
+{
+	if (geo->n_banks <= 0 || geo->blks_per_bank <= 0 || geo->pages_per_blk <= 0 ||
+		geo->op_ratio < 0 || geo->cmt_ratio < 0 || geo->n_buffers <= 0 || geo->n_workers < 0 ||
+		geo->t_read < 0 || geo->t_prog < 0 || geo->t_erase < 0 || geo->t_xfer < 0)
+		return FTL_ERR_INVALID;
+
+	if (geo->n_channels == 0)
+		geo->n_channels = geo->n_banks;
+	if (geo->n_channels < 0 || geo->n_banks % geo->n_channels != 0)
+		return FTL_ERR_INVALID;
+	geo->n_ways = geo->n_banks / geo->n_channels;
+
+	geo->n_ppns_pb = geo->blks_per_bank * geo->pages_per_blk;
+	geo->n_map_pages_pb = geo->n_ppns_pb / N_MAP_ENTRIES_PER_PAGE;
+	geo->n_map_blocks_pb = geo->n_map_pages_pb / geo->pages_per_blk;
+	geo->n_user_blocks_pb = ((geo->blks_per_bank - geo->n_map_blocks_pb) * 100) / (100 + geo->op_ratio);
+	geo->n_op_blocks_pb = geo->blks_per_bank - geo->n_map_blocks_pb - geo->n_user_blocks_pb;
+
+	geo->cmt_size_pb = geo->n_ppns_pb * sizeof(u32) * geo->cmt_ratio / 100;
+	geo->n_cached_map_page_pb = geo->cmt_size_pb / (MAP_ENTRY_SIZE * N_MAP_ENTRIES_PER_PAGE);
+	if (geo->n_cached_map_page_pb <= 0)
+		geo->n_cached_map_page_pb = 1;
+
+	ftl_divisor_init(&geo->div_banks, geo->n_banks);
+	ftl_divisor_init(&geo->div_blks, geo->blks_per_bank);
+	ftl_divisor_init(&geo->div_pages, geo->pages_per_blk);
+
+	// a chunk must divide the LPNs of a bank, so that every bank gets as many
+	if (geo->interleave < FTL_INTERLEAVE_PAGE || geo->interleave > FTL_INTERLEAVE_HASH)
+		return FTL_ERR_INVALID;
+	if (geo->interleave_chunk == 0)
+		geo->interleave_chunk = geo->pages_per_blk;
+	if (geo->interleave_chunk < 0 || N_LPNS_PB % geo->interleave_chunk != 0)
+		return FTL_ERR_INVALID;
+	ftl_divisor_init(&geo->div_chunk, geo->interleave_chunk);
+
+	if (geo->write_bank < FTL_WRITE_BANK_HOME || geo->write_bank > FTL_WRITE_BANK_GC)
+		return FTL_ERR_INVALID;
+	if (geo->superblock < 0 || geo->superblock > 1)
+		return FTL_ERR_INVALID;
+	if (geo->adaptive_split < 0 || geo->adaptive_split > 1)
+		return FTL_ERR_INVALID;
+	if (geo->buffer_policy < FTL_BUFFER_FIFO || geo->buffer_policy > FTL_BUFFER_BLOCK)
+		return FTL_ERR_INVALID;
+	if (geo->flush_watermark < 0 || geo->flush_watermark > 100 || geo->flush_batch < 0 ||
+		geo->drain_watermark < 0 || geo->drain_watermark > 100)
+		return FTL_ERR_INVALID;
+	if (geo->flush_batch == 0)
+		geo->flush_batch = geo->n_banks * N_MAP_ENTRIES_PER_PAGE;
+	if (geo->read_cache < 0 || geo->adaptive_dram < 0 || geo->adaptive_dram > 1 || geo->bypass_sectors < 0)
+		return FTL_ERR_INVALID;
+
+	// GC needs a spare block besides the ones it collects
+	if (geo->n_map_blocks_pb <= N_GC_BLOCKS || geo->n_user_blocks_pb <= N_GC_BLOCKS ||
+		geo->n_op_blocks_pb < 0)
+		return FTL_ERR_INVALID;
+
+	return FTL_SUCCESS;
+}
@@ -0,0 +1,77 @@
+/*
+ * Project1 : Custom DFTL Simulator
+ *  - Embedded Systems Design, ICE3028 (Fall, 2022)
+ *
+ * Single-producer / single-consumer ring
+ *
+ * Fixed-size entries are copied in and out. One thread may push and
+ * one other thread may pop at the same time without locks: the
+ * producer only writes tail, the consumer only writes head, and each
+ * publishes with a release store that the other side acquires.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FTL_RING_PAD	64
+
+struct ftl_ring {
+	unsigned int size;			// power of two
+	unsigned int elem_size;
+	char *slots;
+
+	char pad0[FTL_RING_PAD];
+	unsigned int head;			// next to pop, written by the consumer
+	char pad1[FTL_RING_PAD];
+	unsigned int tail;			// next to push, written by the producer
+	char pad2[FTL_RING_PAD];
+};
+
+static inline void ftl_ring_init(struct ftl_ring *r, unsigned int size, unsigned int elem_size)
+{
+	r->size = size;
+	r->elem_size = elem_size;
+	r->slots = malloc((size_t)size * elem_size);
+	r->head = 0;
+	r->tail = 0;
+}
+
+static inline void ftl_ring_free(struct ftl_ring *r)
+{
+	free(r->slots);
+}
+
+/* returns false if the ring is full */
+static inline bool ftl_ring_push(struct ftl_ring *r, const void *elem)
+{
+	unsigned int tail = r->tail;
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+	if (tail - head == r->size)
+		return false;
+
+	memcpy(r->slots + (size_t)(tail & (r->size - 1)) * r->elem_size, elem, r->elem_size);
+	__atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+/* returns false if the ring is empty */
+static inline bool ftl_ring_pop(struct ftl_ring *r, void *elem)
+{
+	unsigned int head = r->head;
+	unsigned int tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+		return false;
+
+	memcpy(elem, r->slots + (size_t)(head & (r->size - 1)) * r->elem_size, r->elem_size);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+static inline bool ftl_ring_empty(struct ftl_ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
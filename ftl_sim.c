@@ -0,0 +1,337 @@
+/*
+ * Project1 : Custom DFTL Simulator
+ *  - Embedded Systems Design, ICE3028 (Fall, 2022)
+ *
+ * Discrete-event simulation
+ *
+ * Replays a trace in simulated time and reports per-request latency
+ * and IOPS. Events (host arrivals and request completions) are kept
+ * in a min-heap by time. A command runs through the FTL when it
+ * arrives; its NAND operations are placed on the bank timelines
+ * (nand_set_clock), and its completion event is set to the time the
+ * last of them ends. GC runs inside the page op that needs it, so it
+ * holds its bank like any other NAND work.
+ *
+ * Arrivals are closed loop with qd commands outstanding, or open loop
+ * with one command every interval ns.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "ftl.h"
+
+typedef struct {
+	char op;
+	u32 lba;
+	u32 nsect;
+} TRACE_OP;
+
+#define EV_ARRIVAL		0
+#define EV_DONE			1
+
+typedef struct {
+	u64 time;
+	u32 seq;		// events at the same time run in the order they were added
+	int type;
+	int req;		// trace index
+} EVENT;
+
+typedef struct {
+	EVENT *ev;
+	int n;
+	int size;
+	u32 seq;
+} EVENT_HEAP;
+
+static TRACE_OP *trace;
+static int n_trace;
+static unsigned long trace_end;
+static int seed;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s input [output] [config=FILE] [qd=N] [interval=NS] [NAME=value ...]\n", prog);
+	fprintf(stderr, "  NAME: N_BANKS BLKS_PER_BANK PAGES_PER_BLK OP_RATIO CMT_RATIO N_BUFFERS\n"
+					"        T_READ T_PROG T_ERASE T_XFER N_CHANNELS\n"
+					"        INTERLEAVE INTERLEAVE_CHUNK WRITE_BANK SUPERBLOCK ADAPTIVE_SPLIT\n"
+					"        BUFFER_POLICY FLUSH_WATERMARK FLUSH_BATCH READ_CACHE ADAPTIVE_DRAM\n"
+					"        BYPASS_SECTORS DRAIN_WATERMARK\n");
+	fprintf(stderr, "  qd: commands outstanding (1), interval: open loop arrival interval (0, closed loop)\n");
+}
+
+static int load_trace(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	int size = 1024;
+
+	if (!fp) {
+		perror(path);
+		return -1;
+	}
+	if (fscanf(fp, "S %d", &seed) < 1) {
+		fprintf(stderr, "wrong input format\n");
+		fclose(fp);
+		return -1;
+	}
+
+	trace = malloc(sizeof(TRACE_OP) * size);
+	while (fscanf(fp, " %c", &trace[n_trace].op) == 1) {
+		TRACE_OP *t = &trace[n_trace];
+
+		// a flush has no lba or nsect
+		if (t->op == 'F') {
+			t->lba = t->nsect = 0;
+		} else if ((t->op != 'R' && t->op != 'W') || fscanf(fp, "%u %u", &t->lba, &t->nsect) != 2) {
+			fprintf(stderr, "Wrong op type\n");
+			fclose(fp);
+			return -1;
+		}
+		if (trace[n_trace].lba + (unsigned long)trace[n_trace].nsect > trace_end)
+			trace_end = trace[n_trace].lba + (unsigned long)trace[n_trace].nsect;
+		if (++n_trace == size) {
+			size *= 2;
+			trace = realloc(trace, sizeof(TRACE_OP) * size);
+		}
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static bool event_before(const EVENT *a, const EVENT *b)
+{
+	return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+static void push_event(EVENT_HEAP *h, u64 time, int type, int req)
+{
+	int i;
+
+	if (h->n == h->size) {
+		h->size = h->size ? h->size * 2 : 64;
+		h->ev = realloc(h->ev, sizeof(EVENT) * h->size);
+	}
+
+	i = h->n++;
+	h->ev[i] = (EVENT){ .time = time, .seq = h->seq++, .type = type, .req = req };
+	while (i > 0 && event_before(&h->ev[i], &h->ev[(i - 1) / 2])) {
+		EVENT t = h->ev[i];
+		h->ev[i] = h->ev[(i - 1) / 2];
+		h->ev[(i - 1) / 2] = t;
+		i = (i - 1) / 2;
+	}
+}
+
+static bool pop_event(EVENT_HEAP *h, EVENT *e)
+{
+	int i = 0;
+
+	if (h->n == 0)
+		return false;
+
+	*e = h->ev[0];
+	h->ev[0] = h->ev[--h->n];
+	while (1) {
+		int min = i;
+		int l = 2 * i + 1, r = 2 * i + 2;
+		if (l < h->n && event_before(&h->ev[l], &h->ev[min]))
+			min = l;
+		if (r < h->n && event_before(&h->ev[r], &h->ev[min]))
+			min = r;
+		if (min == i)
+			break;
+		EVENT t = h->ev[i];
+		h->ev[i] = h->ev[min];
+		h->ev[min] = t;
+		i = min;
+	}
+	return true;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a, y = *(const u64 *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void show_latency(const char *name, u64 *lat, int n)
+{
+	double sum = 0;
+
+	if (n == 0) {
+		printf("%s latency: -\n", name);
+		return;
+	}
+	qsort(lat, n, sizeof(u64), cmp_u64);
+	for (int i = 0; i < n; i++)
+		sum += lat[i];
+	printf("%s latency (us): avg %.1f, p50 %.1f, p99 %.1f, max %.1f\n", name,
+		   sum / n / 1000., lat[n / 2] / 1000., lat[(int)(n * 0.99)] / 1000., lat[n - 1] / 1000.);
+}
+
+int main(int argc, char **argv)
+{
+	const char *files[2] = { NULL, NULL };
+	int nfiles = 0;
+	struct ftl_geometry config = ftl_default_geometry;
+	const struct ftl_geometry *geo;
+	struct ftl_device *dev;
+	int qd = 1;
+	long interval = 0;
+
+	for (int i = 1; i < argc; i++) {
+		char *eq = strchr(argv[i], '=');
+		if (!eq) {
+			if (nfiles == 2) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			files[nfiles++] = argv[i];
+			continue;
+		}
+
+		*eq = '\0';
+		int ret;
+		if (!strcmp(argv[i], "qd"))
+			ret = (qd = atoi(eq + 1)) > 0 ? FTL_SUCCESS : FTL_ERR_INVALID;
+		else if (!strcmp(argv[i], "interval"))
+			ret = (interval = atol(eq + 1)) >= 0 ? FTL_SUCCESS : FTL_ERR_INVALID;
+		else if (!strcmp(argv[i], "config"))
+			ret = ftl_load_config(&config, eq + 1);
+		else
+			ret = ftl_set_param(&config, argv[i], eq + 1);
+		if (ret != FTL_SUCCESS) {
+			fprintf(stderr, "bad option %s=%s\n", argv[i], eq + 1);
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (nfiles == 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (load_trace(files[0]) < 0)
+		return EXIT_FAILURE;
+	if (files[1] && !freopen(files[1], "w", stdout)) {
+		perror("freopen out");
+		return EXIT_FAILURE;
+	}
+
+	// every page op has to end before its command returns
+	ftl_set_param(&config, "N_WORKERS", "0");
+	if (ftl_open(&dev, &config) != FTL_SUCCESS) {
+		fprintf(stderr, "invalid geometry\n");
+		return EXIT_FAILURE;
+	}
+	geo = ftl_get_geometry(dev);
+	if (trace_end > (unsigned long)N_LPNS * SECTORS_PER_PAGE) {
+		fprintf(stderr, "trace does not fit the geometry\n");
+		return EXIT_FAILURE;
+	}
+
+	EVENT_HEAP heap = { 0 };
+	EVENT e;
+	u64 *arrival = malloc(sizeof(u64) * n_trace);
+	u64 *read_lat = malloc(sizeof(u64) * n_trace);
+	u64 *write_lat = malloc(sizeof(u64) * n_trace);
+	u64 *flush_lat = malloc(sizeof(u64) * n_trace);
+	int n_read = 0, n_write = 0, n_flush = 0;
+	int next = 0;
+	u64 now = 0;
+	unsigned int rand_seed = seed;
+	u32 max_nsect = 0x10000;
+	u32 *buf = malloc(SECTOR_SIZE * max_nsect);
+
+	if (interval > 0) {
+		if (n_trace > 0)
+			push_event(&heap, 0, EV_ARRIVAL, next++);
+	} else {
+		while (next < qd && next < n_trace)
+			push_event(&heap, 0, EV_ARRIVAL, next++);
+	}
+
+	while (pop_event(&heap, &e)) {
+		TRACE_OP *t = &trace[e.req];
+		now = e.time;
+
+		if (e.type == EV_ARRIVAL) {
+			u64 done;
+
+			if (interval > 0 && next < n_trace)
+				push_event(&heap, now + interval, EV_ARRIVAL, next++);
+
+			if (t->nsect > max_nsect) {
+				max_nsect = t->nsect;
+				buf = realloc(buf, SECTOR_SIZE * max_nsect);
+			}
+			arrival[e.req] = now;
+			if (t->op == 'R') {
+				done = ftl_timed_read(dev, now, t->lba, t->nsect, buf);
+			} else if (t->op == 'F') {
+				done = ftl_timed_flush(dev, now);
+			} else {
+				for (u32 j = 0; j < t->nsect; j++)
+					buf[j] = rand_r(&rand_seed) & 0xff;
+				done = ftl_timed_write(dev, now, t->lba, t->nsect, buf);
+			}
+			push_event(&heap, done, EV_DONE, e.req);
+			continue;
+		}
+
+		if (t->op == 'R')
+			read_lat[n_read++] = now - arrival[e.req];
+		else if (t->op == 'F')
+			flush_lat[n_flush++] = now - arrival[e.req];
+		else
+			write_lat[n_write++] = now - arrival[e.req];
+		if (interval == 0 && next < n_trace)
+			push_event(&heap, now, EV_ARRIVAL, next++);
+	}
+
+	// what is still buffered counts in WAF, not in time
+	ftl_flush(dev);
+	const struct ftl_stats *stats = ftl_get_stats(dev);
+
+	printf("Requests: %d (%d reads, %d writes", n_trace, n_read, n_write);
+	if (n_flush)
+		printf(", %d flushes", n_flush);
+	printf(")\n");
+	if (interval > 0)
+		printf("Arrivals: every %ld ns\n", interval);
+	else
+		printf("Queue depth: %d\n", qd);
+	printf("Topology: %d channels x %d ways\n", geo->n_channels, geo->n_ways);
+	printf("NAND latency (us): read %d, program %d, erase %d, transfer %d\n", geo->t_read, geo->t_prog, geo->t_erase, geo->t_xfer);
+	printf("Simulated time: %.3f ms\n", now / 1e6);
+	printf("IOPS: %.0f\n", now ? n_trace * 1e9 / now : 0.);
+	show_latency("Read", read_lat, n_read);
+	show_latency("Write", write_lat, n_write);
+	if (n_flush)
+		show_latency("Flush", flush_lat, n_flush);
+	printf("Bank utilization:");
+	for (int bank = 0; bank < N_BANKS; bank++)
+		printf(" %.1f%%", now ? ftl_bank_busy(dev, bank) * 100. / now : 0.);
+	printf("\n");
+	printf("Channel utilization:");
+	for (int ch = 0; ch < geo->n_channels; ch++)
+		printf(" %.1f%%", now ? ftl_channel_busy(dev, ch) * 100. / now : 0.);
+	printf("\n");
+	printf("Bank imbalance (max / mean NAND ops): %.2f\n", stats->bank_imbalance);
+	printf("Number of GCs: %d, Map GCs: %d\n", stats->gc_cnt, stats->map_gc_cnt);
+	printf("WAF: %.2f\n", (double)((stats->nand_write + stats->gc_write + stats->map_write + stats->map_gc_write) * 8.0 / stats->host_write));
+
+	free(buf);
+	free(arrival);
+	free(read_lat);
+	free(write_lat);
+	free(flush_lat);
+	free(heap.ev);
+	ftl_close(dev);
+	return 0;
+}
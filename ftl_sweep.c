@@ -0,0 +1,389 @@
+/*
+ * Project1 : Custom DFTL Simulator
+ *  - Embedded Systems Design, ICE3028 (Fall, 2022)
+ *
+ * Parameter sweep runner
+ *
+ * Replays one trace for every point of a parameter grid and writes one
+ * CSV row per point. The trace is parsed once; each point opens its
+ * own ftl_device, and worker threads (one per core) take points until
+ * the grid is done.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ftl.h"
+
+#define MAX_PARAMS		8
+#define MAX_VALUES		64
+
+typedef struct {
+	char op;
+	u32 lba;
+	u32 nsect;
+} TRACE_OP;
+
+typedef struct {
+	const char *name;
+	int n_values;
+	int value[MAX_VALUES];
+} SWEEP_PARAM;
+
+/* status of a point */
+#define POINT_OK		0
+#define POINT_INVALID	1	// geometry rejected by ftl_open
+#define POINT_RANGE		2	// trace does not fit the geometry
+
+typedef struct {
+	int status;
+	double seconds;
+	struct ftl_geometry geo;
+	struct ftl_stats stats;
+} POINT_RESULT;
+
+static TRACE_OP *trace;
+static int n_trace;
+static unsigned long trace_end;	// highest lba + nsect in the trace
+static int seed;
+
+static SWEEP_PARAM sweep[MAX_PARAMS];
+static int n_sweep;
+
+static struct ftl_geometry config;
+static POINT_RESULT *res;
+static int n_points;
+static int next_point;
+static pthread_mutex_t next_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s input output.csv [-j jobs] [config=FILE] [NAME=v1,v2,...] [NAME=lo:hi[:step]] ...\n", prog);
+	fprintf(stderr, "  NAME: N_BANKS BLKS_PER_BANK PAGES_PER_BLK OP_RATIO CMT_RATIO N_BUFFERS N_WORKERS\n"
+					"        INTERLEAVE INTERLEAVE_CHUNK WRITE_BANK SUPERBLOCK ADAPTIVE_SPLIT\n"
+					"        BUFFER_POLICY FLUSH_WATERMARK FLUSH_BATCH READ_CACHE ADAPTIVE_DRAM\n"
+					"        BYPASS_SECTORS DRAIN_WATERMARK\n");
+}
+
+static int load_trace(const char *path)
+{
+	FILE *fp = fopen(path, "r");
+	int size = 1024;
+
+	if (!fp) {
+		perror(path);
+		return -1;
+	}
+	if (fscanf(fp, "S %d", &seed) < 1) {
+		fprintf(stderr, "wrong input format\n");
+		fclose(fp);
+		return -1;
+	}
+
+	trace = malloc(sizeof(TRACE_OP) * size);
+	while (fscanf(fp, " %c", &trace[n_trace].op) == 1) {
+		TRACE_OP *t = &trace[n_trace];
+
+		// a flush has no lba or nsect
+		if (t->op == 'F') {
+			t->lba = t->nsect = 0;
+		} else if ((t->op != 'R' && t->op != 'W') || fscanf(fp, "%u %u", &t->lba, &t->nsect) != 2) {
+			fprintf(stderr, "Wrong op type\n");
+			fclose(fp);
+			return -1;
+		}
+		if (trace[n_trace].lba + (unsigned long)trace[n_trace].nsect > trace_end)
+			trace_end = trace[n_trace].lba + (unsigned long)trace[n_trace].nsect;
+		if (++n_trace == size) {
+			size *= 2;
+			trace = realloc(trace, sizeof(TRACE_OP) * size);
+		}
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/*
+ * parse "v1,v2,..." or "lo:hi[:step]" into a sweep parameter
+ */
+static int add_sweep(const char *name, const char *list)
+{
+	SWEEP_PARAM *p;
+	int lo, hi, step = 1;
+
+	if (n_sweep == MAX_PARAMS)
+		return -1;
+	p = &sweep[n_sweep];
+	p->name = name;
+	p->n_values = 0;
+
+	if (sscanf(list, "%d:%d:%d", &lo, &hi, &step) >= 2 && strchr(list, ':')) {
+		if (step <= 0 || hi < lo)
+			return -1;
+		for (int v = lo; v <= hi; v += step) {
+			if (p->n_values == MAX_VALUES)
+				return -1;
+			p->value[p->n_values++] = v;
+		}
+	} else {
+		const char *s = list;
+		while (*s) {
+			char *end;
+			long v = strtol(s, &end, 0);
+			if (end == s || (*end != ',' && *end != '\0') || p->n_values == MAX_VALUES)
+				return -1;
+			p->value[p->n_values++] = (int)v;
+			s = (*end == ',') ? end + 1 : end;
+		}
+	}
+
+	if (p->n_values == 0)
+		return -1;
+	n_sweep++;
+	return 0;
+}
+
+static void apply_point(struct ftl_geometry *geo, int point)
+{
+	char value[16];
+
+	for (int i = n_sweep - 1; i >= 0; i--) {
+		snprintf(value, sizeof(value), "%d", sweep[i].value[point % sweep[i].n_values]);
+		ftl_set_param(geo, sweep[i].name, value);
+		point /= sweep[i].n_values;
+	}
+}
+
+/*
+ * run one point on its own device
+ */
+static void run_point(int point, POINT_RESULT *r)
+{
+	struct ftl_geometry point_geo = config;
+	const struct ftl_geometry *geo = &point_geo;
+	struct ftl_device *dev;
+	struct timespec t0, t1;
+	unsigned int rand_seed = seed;
+	u32 max_nsect = 0x10000;
+	u32 *buf;
+
+	memset(r, 0, sizeof(*r));
+	apply_point(&point_geo, point);
+	r->geo = point_geo;
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (ftl_open(&dev, &point_geo) != FTL_SUCCESS) {
+		r->status = POINT_INVALID;
+		return;
+	}
+	geo = ftl_get_geometry(dev);
+	r->geo = *geo;
+	if (trace_end > (unsigned long)N_LPNS * SECTORS_PER_PAGE) {
+		r->status = POINT_RANGE;
+		ftl_close(dev);
+		return;
+	}
+
+	buf = malloc(SECTOR_SIZE * max_nsect);
+	for (int i = 0; i < n_trace; i++) {
+		TRACE_OP *t = &trace[i];
+
+		if (t->nsect > max_nsect) {
+			max_nsect = t->nsect;
+			buf = realloc(buf, SECTOR_SIZE * max_nsect);
+		}
+
+		if (t->op == 'R') {
+			ftl_read(dev, t->lba, t->nsect, buf);
+		} else if (t->op == 'F') {
+			ftl_flush(dev);
+		} else {
+			for (u32 j = 0; j < t->nsect; j++)
+				buf[j] = rand_r(&rand_seed) & 0xff;
+			ftl_write(dev, t->lba, t->nsect, buf);
+		}
+	}
+	ftl_flush(dev);
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	r->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	r->stats = *ftl_get_stats(dev);
+	free(buf);
+	ftl_close(dev);
+}
+
+static void *sweep_worker(void *arg)
+{
+	while (1) {
+		pthread_mutex_lock(&next_lock);
+		int point = next_point++;
+		pthread_mutex_unlock(&next_lock);
+		if (point >= n_points)
+			break;
+
+		run_point(point, &res[point]);
+		fprintf(stderr, "point %d/%d done\n", point + 1, n_points);
+	}
+	return NULL;
+}
+
+/*
+ * swept parameters other than the six geometry columns every row has
+ */
+static bool extra_column(int i)
+{
+	static const char *base[] = { "N_BANKS", "BLKS_PER_BANK", "PAGES_PER_BLK", "OP_RATIO", "CMT_RATIO", "N_BUFFERS" };
+
+	for (int j = 0; j < (int)(sizeof(base) / sizeof(base[0])); j++)
+		if (!strcmp(sweep[i].name, base[j]))
+			return false;
+	return true;
+}
+
+/*
+ * hit rate in percent, empty if there was no lookup
+ */
+static void write_rate(FILE *fp, long hit, long miss)
+{
+	if (hit + miss)
+		fprintf(fp, ",%.2f", hit * 100. / (hit + miss));
+	else
+		fprintf(fp, ",");
+}
+
+static void write_csv(FILE *fp, POINT_RESULT *res, int n_points)
+{
+	static const char *status[] = { "ok", "invalid", "range" };
+
+	fprintf(fp, "point,N_BANKS,BLKS_PER_BANK,PAGES_PER_BLK,OP_RATIO,CMT_RATIO,N_BUFFERS");
+	for (int j = 0; j < n_sweep; j++)
+		if (extra_column(j))
+			fprintf(fp, ",%s", sweep[j].name);
+	fprintf(fp, ",status,"
+				"host_read,host_write,nand_read,nand_write,gc_read,gc_write,gc_cnt,"
+				"map_read,map_write,map_gc_cnt,map_gc_read,map_gc_write,"
+				"cache_hit_rate,prefetch_hit_rate,read_cache_hit_rate,buffer_hit_rate,bypass_write,WAF,RAF,bank_imbalance,gc_seconds,seconds\n");
+
+	for (int i = 0; i < n_points; i++) {
+		POINT_RESULT *r = &res[i];
+		struct ftl_stats *s = &r->stats;
+
+		fprintf(fp, "%d,%d,%d,%d,%d,%d,%d", i,
+				r->geo.n_banks, r->geo.blks_per_bank, r->geo.pages_per_blk,
+				r->geo.op_ratio, r->geo.cmt_ratio, r->geo.n_buffers);
+		for (int j = 0; j < n_sweep; j++) {
+			int value;
+			if (extra_column(j) && ftl_get_param(&r->geo, sweep[j].name, &value) == FTL_SUCCESS)
+				fprintf(fp, ",%d", value);
+		}
+		fprintf(fp, ",%s", status[r->status]);
+		if (r->status != POINT_OK) {
+			fprintf(fp, ",,,,,,,,,,,,,,,,,,,,,,\n");
+			continue;
+		}
+		fprintf(fp, ",%ld,%ld,%ld,%ld,%ld,%ld,%d,%ld,%ld,%d,%ld,%ld",
+				s->host_read, s->host_write, s->nand_read, s->nand_write,
+				s->gc_read, s->gc_write, s->gc_cnt,
+				s->map_read, s->map_write, s->map_gc_cnt, s->map_gc_read, s->map_gc_write);
+		write_rate(fp, s->cache_hit, s->cache_miss + s->prefetch_hit);
+		write_rate(fp, s->prefetch_hit, s->cache_hit + s->cache_miss);
+		write_rate(fp, s->read_cache_hit, s->read_cache_miss);
+		write_rate(fp, s->buffer_hit, s->buffer_miss);
+		fprintf(fp, ",%ld", s->bypass_write);
+		fprintf(fp, ",%.2f,%.2f,%.2f,%.6f,%.3f\n",
+				(s->nand_write + s->gc_write + s->map_write + s->map_gc_write) * 8.0 / s->host_write,
+				(s->nand_read + s->gc_read + s->map_read + s->map_gc_read) * 8.0 / s->host_read,
+				s->bank_imbalance, s->gc_time, r->seconds);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	const char *files[2] = { NULL, NULL };
+	int nfiles = 0;
+	int jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	pthread_t *worker;
+	FILE *out;
+
+	if (jobs < 1)
+		jobs = 1;
+	config = ftl_default_geometry;
+	for (int i = 1; i < argc; i++) {
+		char *eq = strchr(argv[i], '=');
+		if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+			char *end;
+			long v = strtol(argv[++i], &end, 10);
+			if (end == argv[i] || *end != '\0' || v <= 0) {
+				fprintf(stderr, "bad option -j %s\n", argv[i]);
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			jobs = (int)v;
+			continue;
+		}
+		if (!eq) {
+			if (nfiles == 2) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			files[nfiles++] = argv[i];
+			continue;
+		}
+
+		*eq = '\0';
+		int ret;
+		if (!strcmp(argv[i], "config")) {
+			ret = ftl_load_config(&config, eq + 1);
+		} else {
+			char value[16];
+			ret = add_sweep(argv[i], eq + 1);
+			// also checks the name
+			if (ret == FTL_SUCCESS) {
+				snprintf(value, sizeof(value), "%d", sweep[n_sweep - 1].value[0]);
+				ret = ftl_set_param(&config, argv[i], value);
+			}
+		}
+		if (ret != FTL_SUCCESS) {
+			fprintf(stderr, "bad option %s=%s\n", argv[i], eq + 1);
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (nfiles != 2) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	if (load_trace(files[0]) < 0)
+		return EXIT_FAILURE;
+	if (!(out = fopen(files[1], "w"))) {
+		perror(files[1]);
+		return EXIT_FAILURE;
+	}
+
+	n_points = 1;
+	for (int i = 0; i < n_sweep; i++)
+		n_points *= sweep[i].n_values;
+	if (jobs > n_points)
+		jobs = n_points;
+
+	res = calloc(n_points, sizeof(POINT_RESULT));
+	worker = malloc(sizeof(pthread_t) * jobs);
+	for (int i = 0; i < jobs; i++)
+		pthread_create(&worker[i], NULL, sweep_worker, NULL);
+	for (int i = 0; i < jobs; i++)
+		pthread_join(worker[i], NULL);
+	free(worker);
+
+	write_csv(out, res, n_points);
+	fclose(out);
+	return 0;
+}
@@ -15,19 +15,34 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdbool.h>
 
-#include "ftl3.h"
+#include "ftl.h"
 
+/*
+ * Trace op on a queue pair
+ *
+ * Ops are submitted in trace order and printed in the same order,
+ * whatever order they complete in.
+ */
+typedef struct {
+	char op;
+	u32 lba;
+	u32 nsect;
+	u32 *buf;
+	bool done;
+} SLOT;
 
-struct ftl_stats stats;
 
-static void show_info(void)
+static void show_info(const struct ftl_geometry *geo)
 {
 	printf("Bank: %d\n", N_BANKS);
 	printf("Blocks / Bank: %d blocks\n", BLKS_PER_BANK);
 	printf("Pages / Block: %d pages\n", PAGES_PER_BLK);
 	printf("Sectors per Page: %lu\n", SECTORS_PER_PAGE);
 	printf("OP ratio: %d%%\n", OP_RATIO);
+	printf("CMT ratio: %d%%\n", CMT_RATIO);
+	printf("Buffers: %d pages\n", N_BUFFERS);
 	printf("Physical Blocks: %d\n", N_BLOCKS);
 	printf("User Blocks: %d\n", (int)N_USER_BLOCKS);
 	printf("OP Blocks: %d\n", (int)N_OP_BLOCKS);
@@ -41,31 +56,160 @@ static u32 get_data()
 	return rand() & 0xff;
 }
 
-static void show_stat(void)
+static void show_split(struct ftl_device *dev, const struct ftl_geometry *geo)
+{
+	const struct ftl_split_sample *h;
+	double data = 0, map = 0;
+	int moves = 0;
+	int n;
+
+	for (int bank = 0; bank < N_BANKS; bank++) {
+		n = ftl_get_split_history(dev, bank, &h);
+		data += h[n - 1].data_blocks;
+		map += h[n - 1].map_blocks;
+		moves += n - 1;
+	}
+	ftl_get_split_history(dev, 0, &h);
+	printf("Block split (data / map per bank): start %d / %d, end %.1f / %.1f, %d moves\n",
+		   h[0].data_blocks, h[0].map_blocks, data / N_BANKS, map / N_BANKS, moves);
+}
+
+static void show_dram(struct ftl_device *dev)
+{
+	const struct ftl_dram_sample *h;
+	int n = ftl_get_dram_history(dev, &h);
+
+	printf("DRAM split (buffer / read cache / CMT pages): start %d / %d / %d, end %d / %d / %d, %d moves\n",
+		   h[0].buffer_pages, h[0].read_cache_pages, h[0].cmt_pages,
+		   h[n - 1].buffer_pages, h[n - 1].read_cache_pages, h[n - 1].cmt_pages, n - 1);
+}
+
+static void show_stat(const struct ftl_geometry *geo, const struct ftl_stats *stats)
 {
 	printf("\nResults ------\n");
-	printf("Host read: %d, writes: %d\n", stats.host_read, stats.host_write);
-	printf("Nand read: %d, writes: %d\n", stats.nand_read, stats.nand_write);
-	printf("GC read: %d, writes: %d\n", stats.gc_read, stats.gc_write);
-	printf("Number of GCs: %d\n", stats.gc_cnt);
-	printf("MAP read : %ld, MAP writes : %ld\n", stats.map_read, stats.map_write);
-	printf("Number of MAP GCs : %d\n", stats.map_gc_cnt);
-	printf("Number of MAP GC read : %ld, Number of MAP GC write : %ld\n",stats.map_gc_read, stats.map_gc_write);
-	printf("Valid pages per GC: %.2f pages\n", (double)stats.gc_write / stats.gc_cnt);
-	printf("Valid pages per Map GC: %.2f pages\n", (double)stats.map_gc_write / stats.map_gc_cnt);
-	printf("Cache hit rate : %.2f %%\n", (double)(stats.cache_hit*100. / (stats.cache_hit + stats.cache_miss)));
-	printf("WAF: %.2f\n", (double)((stats.nand_write + stats.gc_write + stats.map_write + stats.map_gc_write) * 8.0 / stats.host_write));
-	printf("RAF : %.2f\n", (double)((stats.nand_read + stats.gc_read + stats.map_read + stats.map_gc_read) * 8.0 / stats.host_read));
+	printf("Host read: %d, writes: %d\n", stats->host_read, stats->host_write);
+	printf("Nand read: %d, writes: %d\n", stats->nand_read, stats->nand_write);
+	printf("GC read: %d, writes: %d\n", stats->gc_read, stats->gc_write);
+	printf("Number of GCs: %d\n", stats->gc_cnt);
+	printf("MAP read : %ld, MAP writes : %ld\n", stats->map_read, stats->map_write);
+	printf("Number of MAP GCs : %d\n", stats->map_gc_cnt);
+	printf("Number of MAP GC read : %ld, Number of MAP GC write : %ld\n",stats->map_gc_read, stats->map_gc_write);
+	printf("Valid pages per GC: %.2f pages\n", (double)stats->gc_write / stats->gc_cnt);
+	printf("Valid pages per Map GC: %.2f pages\n", (double)stats->map_gc_write / stats->map_gc_cnt);
+	printf("GC time (wall clock): %.3f ms, %.2f us per GC, max %.2f us\n", stats->gc_time * 1e3,
+		   stats->gc_cnt ? stats->gc_time * 1e6 / stats->gc_cnt : 0., stats->gc_time_max * 1e6);
+	long lookups = stats->cache_hit + stats->cache_miss + stats->prefetch_hit;
+	printf("Cache hit rate : %.2f %%\n", (double)(stats->cache_hit*100. / lookups));
+	printf("Max cached map pages per bank : %d (%d raw)\n", stats->cmt_max_cached, N_CACHED_MAP_PAGE_PB);
+	printf("Prefetch read : %ld, hit : %ld (%.2f %%), waste : %ld\n", stats->prefetch_read, stats->prefetch_hit,
+		   stats->prefetch_hit * 100. / lookups, stats->prefetch_waste);
+	if (geo->read_cache || geo->adaptive_dram)
+		printf("Read cache hit rate : %.2f %% (%ld of %ld pages)\n",
+			   stats->read_cache_hit * 100. / (stats->read_cache_hit + stats->read_cache_miss),
+			   stats->read_cache_hit, stats->read_cache_hit + stats->read_cache_miss);
+	if (geo->bypass_sectors)
+		printf("Write buffer hit rate : %.2f %% (%ld of %ld pages), bypassed : %ld pages\n",
+			   stats->buffer_hit * 100. / (stats->buffer_hit + stats->buffer_miss),
+			   stats->buffer_hit, stats->buffer_hit + stats->buffer_miss, stats->bypass_write);
+	printf("Bank imbalance (max / mean NAND ops): %.2f\n", stats->bank_imbalance);
+	printf("WAF: %.2f\n", (double)((stats->nand_write + stats->gc_write + stats->map_write + stats->map_gc_write) * 8.0 / stats->host_write));
+	printf("RAF : %.2f\n", (double)((stats->nand_read + stats->gc_read + stats->map_read + stats->map_gc_read) * 8.0 / stats->host_read));
 
 }
 
+static void usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [input [output]] [config=FILE] [qd=N] [qpairs=N] [NAME=value ...]\n", prog);
+	fprintf(stderr, "  NAME: N_BANKS BLKS_PER_BANK PAGES_PER_BLK OP_RATIO CMT_RATIO N_BUFFERS N_WORKERS\n"
+					"        INTERLEAVE INTERLEAVE_CHUNK WRITE_BANK SUPERBLOCK ADAPTIVE_SPLIT\n"
+					"        BUFFER_POLICY FLUSH_WATERMARK FLUSH_BATCH READ_CACHE ADAPTIVE_DRAM\n"
+					"        BYPASS_SECTORS DRAIN_WATERMARK\n");
+	fprintf(stderr, "  qd: commands outstanding per queue pair (1), qpairs: queue pairs (1)\n");
+}
+
+static void print_slot(SLOT *s)
+{
+	if (s->op == 'F') {
+		printf("Flush\n");
+		return;
+	}
+	printf("%s(%u,%u): [ ", s->op == 'R' ? "Read" : "Write", s->lba, s->nsect);
+	for (int i = 0; i < s->nsect; i++)
+		printf("%2x ", s->buf[i]);
+	printf("]\n");
+}
+
+/*
+ * read the next trace op into s
+ *
+ * Returns:
+ *   1 if an op was read, 0 at the end of the trace, -1 on a bad op
+ */
+static int next_op(const struct ftl_geometry *geo, SLOT *s)
+{
+	if (scanf(" %c", &s->op) < 1)
+		return 0;
+	if (s->op == 'F') {
+		s->lba = s->nsect = 0;
+		s->buf = NULL;
+		return 1;
+	}
+	if (s->op != 'R' && s->op != 'W')
+		return -1;
+
+	scanf("%d %d", &s->lba, &s->nsect);
+	assert(s->lba >= 0 && s->lba + s->nsect <= N_LPNS * SECTORS_PER_PAGE);
+	s->buf = malloc(SECTOR_SIZE * s->nsect);
+	if (s->op == 'W') {
+		for (int i = 0; i < s->nsect; i++)
+			s->buf[i] = get_data();
+	}
+	return 1;
+}
 int main(int argc, char **argv)
 {
-	if (argc >= 2 && !freopen(argv[1], "r", stdin)) {
+	const char *files[2] = { NULL, NULL };
+	int nfiles = 0;
+	struct ftl_geometry config = ftl_default_geometry;
+	const struct ftl_geometry *geo;
+	struct ftl_device *dev;
+	int qd = 1;
+	int n_qpairs = 1;
+
+	// geometry options are applied in the order given
+	for (int i = 1; i < argc; i++) {
+		char *eq = strchr(argv[i], '=');
+		if (!eq) {
+			if (nfiles == 2) {
+				usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			files[nfiles++] = argv[i];
+			continue;
+		}
+
+		*eq = '\0';
+		int ret;
+		if (!strcmp(argv[i], "qd"))
+			ret = (qd = atoi(eq + 1)) > 0 ? FTL_SUCCESS : FTL_ERR_INVALID;
+		else if (!strcmp(argv[i], "qpairs"))
+			ret = (n_qpairs = atoi(eq + 1)) > 0 ? FTL_SUCCESS : FTL_ERR_INVALID;
+		else if (!strcmp(argv[i], "config"))
+			ret = ftl_load_config(&config, eq + 1);
+		else
+			ret = ftl_set_param(&config, argv[i], eq + 1);
+		if (ret != FTL_SUCCESS) {
+			fprintf(stderr, "bad option %s=%s\n", argv[i], eq + 1);
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	if (files[0] && !freopen(files[0], "r", stdin)) {
 		perror("freopen in");
 		return EXIT_FAILURE;
 	}
-	if (argc >= 3 && !freopen(argv[2], "w", stdout)) {
+	if (files[1] && !freopen(files[1], "w", stdout)) {
 		perror("freopen out");
 		return EXIT_FAILURE;
 	}
@@ -77,48 +221,79 @@ int main(int argc, char **argv)
 	}
 	srand(seed);
 
-	ftl_open();
-	show_info();
-
-	while (1) {
-		int i;
-		char op;
-		u32 lba;
-		u32 nsect;
-		u32 *buf;
-		if (scanf(" %c", &op) < 1)
-			break;
-		switch (op) {
-		case 'R':
-			scanf("%d %d", &lba, &nsect);
-                        assert(lba >= 0 && lba + nsect <= N_LPNS * SECTORS_PER_PAGE);
-			buf = malloc(SECTOR_SIZE * nsect);
-			ftl_read(lba, nsect, buf);
-			printf("Read(%u,%u): [ ", lba, nsect);
-			for (i = 0; i < nsect; i++)
-				printf("%2x ", buf[i]);
-			printf("]\n");
-                        free(buf);
-			break;
-		case 'W':
-			scanf("%d %d", &lba, &nsect);
-                        assert(lba >= 0 && lba + nsect <= N_LPNS * SECTORS_PER_PAGE);
-			buf = malloc(SECTOR_SIZE * nsect);
-			for (i = 0; i < nsect; i++)
-				buf[i] = get_data();
-			ftl_write(lba, nsect, buf);
-			printf("Write(%u,%u): [ ", lba, nsect);
-			for (i = 0; i < nsect; i++)
-				printf("%2x ", buf[i]);
-			printf("]\n");
-                        free(buf);
-			break;
-		default:
-			fprintf(stderr, "Wrong op type\n");
-			return EXIT_FAILURE;
+	if (ftl_open(&dev, &config) != FTL_SUCCESS) {
+		fprintf(stderr, "invalid geometry\n");
+		return EXIT_FAILURE;
+	}
+	geo = ftl_get_geometry(dev);
+	show_info(geo);
+
+	/*
+	 * keep up to qd ops in flight on each queue pair, window slot i
+	 * goes to queue pair i % qpairs and has tag i
+	 */
+	int window = qd * n_qpairs;
+	SLOT *slot = calloc(window, sizeof(SLOT));
+	struct ftl_qpair **qp = malloc(sizeof(struct ftl_qpair *) * n_qpairs);
+	struct ftl_cpl *cpl = malloc(sizeof(struct ftl_cpl) * qd);
+	int head = 0, count = 0;
+	int ret = 1;
+
+	for (int i = 0; i < n_qpairs; i++)
+		ftl_qpair_create(dev, &qp[i], qd);
+
+	while (ret > 0 || count > 0) {
+		while (ret > 0 && count < window) {
+			int i = (head + count) % window;
+			ret = next_op(geo, &slot[i]);
+			if (ret < 0) {
+				fprintf(stderr, "Wrong op type\n");
+				return EXIT_FAILURE;
+			}
+			if (ret == 0)
+				break;
+
+			struct ftl_cmd cmd = {
+				.opcode = slot[i].op == 'R' ? FTL_CMD_READ : slot[i].op == 'W' ? FTL_CMD_WRITE : FTL_CMD_FLUSH,
+				.tag = i, .lba = slot[i].lba, .nsect = slot[i].nsect, .buf = slot[i].buf,
+			};
+			slot[i].done = false;
+			ftl_submit(qp[i % n_qpairs], &cmd);
+			count++;
+		}
+
+		int reaped = 0;
+		for (int q = 0; q < n_qpairs; q++) {
+			int n = ftl_poll(qp[q], cpl, qd);
+			for (int i = 0; i < n; i++)
+				slot[cpl[i].tag].done = true;
+			reaped += n;
+		}
+		// nothing came back, sleep until the oldest command can
+		if (reaped == 0 && count > 0 && !slot[head].done)
+			ftl_qpair_wait(qp[head % n_qpairs]);
+
+		while (count > 0 && slot[head].done) {
+			print_slot(&slot[head]);
+			free(slot[head].buf);
+			head = (head + 1) % window;
+			count--;
 		}
 	}
 
-	show_stat();
+	for (int i = 0; i < n_qpairs; i++)
+		ftl_qpair_destroy(qp[i]);
+	free(qp);
+	free(cpl);
+	free(slot);
+
+	// what is still buffered counts too
+	ftl_flush(dev);
+	show_stat(geo, ftl_get_stats(dev));
+	if (geo->adaptive_split)
+		show_split(dev, geo);
+	if (geo->adaptive_dram)
+		show_dram(dev);
+	ftl_close(dev);
 	return 0;
 }
@@ -16,7 +16,7 @@
 #include <string.h>
 #include <stdbool.h>
 
-#include "ftl3.h"
+#include "ftl.h"
 #include "nand.h"
 
 /*
@@ -27,21 +27,135 @@ typedef struct page{
 	unsigned int data[PAGE_DATA_SIZE / sizeof(unsigned int)];
 	unsigned int spare[PAGE_SPARE_SIZE / sizeof(unsigned int)];
 }page;
-page ***memory;
-
-bool ***meta_data;
 
 #define WRITING -2
 #define NOWRITING -1
-int *pre_write;
-int *info;
 
+struct nand_device {
+	page ***memory;
+	bool ***meta_data;
+	int (*pre_write)[4];	// per bank: bank, blk, page of the last write, WRITING / NOWRITING
+	int info[3];		// nbanks, nblks, npages
+
+	// timing, ns
+	unsigned int t_read, t_prog, t_erase, t_xfer;
+	int nchannels;
+	bool timed;			// set by the first nand_set_clock
+	u64 now;
+	u64 last_end;		// latest end of an operation since the clock was set
+	u64 *bank_free;		// when the last operation of the die ends
+	u64 *bank_busy;		// total time the die was busy
+	u64 *bank_work;		// total time of its operations, timed or not
+	struct nand_channel *channel;
+};
+
+/*
+ * Channel bus
+ *
+ * Dies queue their own operations in order, but a die can reach its
+ * transfer long after another die booked a later one, so the bus keeps
+ * its booked intervals (sorted, merged when they touch) and transfers
+ * go into the first gap that fits. Intervals over before the clock are
+ * dropped.
+ */
+struct nand_channel {
+	u64 (*iv)[2];		// start, end
+	int n;
+	int size;
+	u64 busy;
+};
+
+#define NAND_CHANNEL(nand, bank)	((bank) % (nand)->nchannels)
 
-unsigned int initial_data[PAGE_DATA_SIZE / sizeof(unsigned int)];
-unsigned int initial_spare[PAGE_SPARE_SIZE / sizeof(unsigned int)];
+static u64 later(u64 a, u64 b)
+{
+	return a > b ? a : b;
+}
+
+/*
+ * book len ns on a channel at t or later
+ *
+ * Returns:
+ *   the end of the transfer
+ */
+static u64 channel_book(struct nand_device *nand, struct nand_channel *c, u64 t, u64 len)
+{
+	int drop = 0;
+	int i;
+
+	while (drop < c->n && c->iv[drop][1] <= nand->now)
+		drop++;
+	if (drop) {
+		memmove(c->iv, c->iv + drop, sizeof(c->iv[0]) * (c->n - drop));
+		c->n -= drop;
+	}
+
+	// first interval that ends after t
+	int lo = 0, hi = c->n;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (c->iv[mid][1] <= t)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (i = lo; i < c->n && c->iv[i][0] < t + len; i++)
+		t = later(t, c->iv[i][1]);
+
+	c->busy += len;
+	if (i > 0 && c->iv[i - 1][1] == t) {
+		c->iv[i - 1][1] = t + len;
+		if (i < c->n && c->iv[i][0] == t + len) {
+			c->iv[i - 1][1] = c->iv[i][1];
+			memmove(c->iv + i, c->iv + i + 1, sizeof(c->iv[0]) * (c->n - i - 1));
+			c->n--;
+		}
+	} else if (i < c->n && c->iv[i][0] == t + len) {
+		c->iv[i][0] = t;
+	} else {
+		if (c->n == c->size) {
+			c->size = c->size ? c->size * 2 : 16;
+			c->iv = realloc(c->iv, sizeof(c->iv[0]) * c->size);
+		}
+		memmove(c->iv + i + 1, c->iv + i, sizeof(c->iv[0]) * (c->n - i));
+		c->iv[i][0] = t;
+		c->iv[i][1] = t + len;
+		c->n++;
+	}
+	return t + len;
+}
+
+/*
+ * time one operation on a die and its channel
+ * @t_array: sensing, program or erase time on the die
+ * @xfer: a page moves over the channel
+ * @xfer_in: it moves before the array time (program), not after (read)
+ */
+static void nand_charge(struct nand_device *nand, int bank, unsigned int t_array, bool xfer, bool xfer_in)
+{
+	struct nand_channel *c = &nand->channel[NAND_CHANNEL(nand, bank)];
+	u64 start, t;
+
+	nand->bank_work[bank] += t_array + (xfer ? nand->t_xfer : 0);
+	if (!nand->timed)
+		return;
+
+	start = t = later(nand->now, nand->bank_free[bank]);
+	if (xfer && xfer_in && nand->t_xfer)
+		t = channel_book(nand, c, t, nand->t_xfer);
+	t += t_array;
+	// the page register holds read data until the bus is free
+	if (xfer && !xfer_in && nand->t_xfer)
+		t = channel_book(nand, c, t, nand->t_xfer);
+
+	nand->bank_free[bank] = t;
+	nand->bank_busy[bank] += t - start;
+	nand->last_end = later(nand->last_end, t);
+}
 
 /*
  * initialize the NAND flash memory
+ * @nand: set to the new NAND instance
  * @nbanks: number of bank
  * @nblks: number of blocks per bank
  * @npages: number of pages per block
@@ -50,20 +164,19 @@ unsigned int initial_spare[PAGE_SPARE_SIZE / sizeof(unsigned int)];
  *   0 on success
  *   NAND_ERR_INVALID if given dimension is invalid
  */
-int nand_init(int nbanks, int nblks, int npages)
+int nand_init(struct nand_device **nand_, int nbanks, int nblks, int npages)
 {
+	struct nand_device *nand;
+	page ***memory;
+	bool ***meta_data;
+
 	if (nbanks <= 0 || 
 		nblks <= 0 || 
 		npages <= 0) {
 		return NAND_ERR_INVALID;
 	}
 
-	for (int i = 0; i < PAGE_DATA_SIZE / sizeof(unsigned int); i++) {
-		initial_data[i] = 0xffffffff;
-	}
-	for (int i = 0; i < PAGE_SPARE_SIZE / sizeof(unsigned int); i++) {
-		initial_spare[i] = 0xffffffff;
-	}
+	nand = malloc(sizeof(struct nand_device));
 
 	memory = malloc((sizeof(page **)) * nbanks);
 	meta_data = malloc(sizeof(bool **) * nbanks);
@@ -97,18 +210,130 @@ int nand_init(int nbanks, int nblks, int npages)
 		} 
 	}
 
-	pre_write = malloc(sizeof(int) * 3);
-	info = malloc(sizeof(int) * 3);
-	for (int i = 0 ; i < 4 ; i++) {
-		pre_write[i] = -1;
+	// banks are tracked apart so that they can be driven from different threads
+	nand->pre_write = malloc(sizeof(int [4]) * nbanks);
+	for (int depth = 0; depth < nbanks; depth++) {
+		for (int i = 0 ; i < 4 ; i++) {
+			nand->pre_write[depth][i] = -1;
+		}
+	}
+
+	nand->t_read = nand->t_prog = nand->t_erase = nand->t_xfer = 0;
+	nand->nchannels = nbanks;
+	nand->timed = false;
+	nand->now = 0;
+	nand->last_end = 0;
+	nand->bank_free = calloc(nbanks, sizeof(u64));
+	nand->bank_busy = calloc(nbanks, sizeof(u64));
+	nand->bank_work = calloc(nbanks, sizeof(u64));
+	nand->channel = calloc(nbanks, sizeof(struct nand_channel));
+
+	nand->memory = memory;
+	nand->meta_data = meta_data;
+	nand->info[0] = nbanks;
+	nand->info[1] = nblks;
+	nand->info[2] = npages;
+	*nand_ = nand;
+	return NAND_SUCCESS;
+}
+
+/*
+ * free the NAND flash memory
+ */
+void nand_close(struct nand_device *nand)
+{
+	for (int depth = 0; depth < nand->info[0]; depth++)
+	{
+		for (int row = 0; row < nand->info[1]; row++)
+		{
+			free(nand->memory[depth][row]);
+			free(nand->meta_data[depth][row]);
+		}
+		free(nand->memory[depth]);
+		free(nand->meta_data[depth]);
 	}
+	free(nand->memory);
+	free(nand->meta_data);
+	free(nand->pre_write);
+	free(nand->bank_free);
+	free(nand->bank_busy);
+	free(nand->bank_work);
+	for (int i = 0; i < nand->info[0]; i++)
+		free(nand->channel[i].iv);
+	free(nand->channel);
+	free(nand);
+}
+
+/*
+ * set the latency of each operation and of a page transfer in ns,
+ * all 0 by default
+ */
+void nand_set_timing(struct nand_device *nand, unsigned int t_read, unsigned int t_prog, unsigned int t_erase, unsigned int t_xfer)
+{
+	nand->t_read = t_read;
+	nand->t_prog = t_prog;
+	nand->t_erase = t_erase;
+	nand->t_xfer = t_xfer;
+}
 
-	info[0] = nbanks;
-	info[1] = nblks;
-	info[2] = npages;
+/*
+ * spread the banks over nchannels channels, one bank per channel by
+ * default
+ *
+ * Returns:
+ *   0 on success
+ *   NAND_ERR_INVALID if the banks do not divide evenly
+ */
+int nand_set_channels(struct nand_device *nand, int nchannels)
+{
+	if (nchannels <= 0 || nchannels > nand->info[0] || nand->info[0] % nchannels != 0)
+		return NAND_ERR_INVALID;
+	nand->nchannels = nchannels;
 	return NAND_SUCCESS;
 }
 
+/*
+ * set the time at which the following operations are issued
+ */
+void nand_set_clock(struct nand_device *nand, u64 now)
+{
+	nand->timed = true;
+	nand->now = now;
+	nand->last_end = now;
+}
+
+/*
+ * when the operations issued since the clock was set are all done
+ */
+u64 nand_last_end(struct nand_device *nand)
+{
+	return nand->last_end;
+}
+
+u64 nand_bank_free(struct nand_device *nand, int bank)
+{
+	return nand->bank_free[bank];
+}
+
+u64 nand_bank_busy(struct nand_device *nand, int bank)
+{
+	return nand->bank_busy[bank];
+}
+
+/*
+ * array and transfer time of every operation on the die, also before
+ * the clock is set
+ */
+u64 nand_bank_work(struct nand_device *nand, int bank)
+{
+	return nand->bank_work[bank];
+}
+
+u64 nand_channel_busy(struct nand_device *nand, int channel)
+{
+	return nand->channel[channel].busy;
+}
+
 /*
  * write data and spare into the NAND flash memory page
  *
@@ -118,76 +343,77 @@ int nand_init(int nbanks, int nblks, int npages)
  *   NAND_ERR_OVERWRITE if target page is already written
  *   NAND_ERR_POSITION if target page is empty but not the position to be written
  */
-int nand_write(int bank, int blk, int page, void *data, void *spare)
+int nand_write(struct nand_device *nand, int bank, int blk, int page, void *data, void *spare)
 {
 	if (bank < 0 || blk < 0 || page < 0 ||
-		bank >= info[0] || blk >= info[1] || page >= info[2]) {
+		bank >= nand->info[0] || blk >= nand->info[1] || page >= nand->info[2]) {
 		return NAND_ERR_INVALID;
 	}
 
 	/*
-	if (memcmp(memory[bank][blk][page].data, initial_data, sizeof(initial_data)) &&
-		memcmp(memory[bank][blk][page].spare, initial_spare, sizeof(initial_spare))) {
+	if (memcmp(nand->memory[bank][blk][page].data, initial_data, sizeof(initial_data)) &&
+		memcmp(nand->memory[bank][blk][page].spare, initial_spare, sizeof(initial_spare))) {
 		return NAND_ERR_OVERWRITE;
 	}
 	*/
-	if (meta_data[bank][blk][page] == true) {
+	if (nand->meta_data[bank][blk][page] == true) {
 		return NAND_ERR_OVERWRITE;
 	}
 
-	if ((pre_write[3] == WRITING && 
-	    (pre_write[0] == bank && pre_write[1] == blk) &&
-	   !(pre_write[2] == page - 1)))
+	if ((nand->pre_write[bank][3] == WRITING && 
+	    (nand->pre_write[bank][0] == bank && nand->pre_write[bank][1] == blk) &&
+	   !(nand->pre_write[bank][2] == page - 1)))
 	{
 		return NAND_ERR_POSITION;
 	}
 
 	/*
-	for (int i = 0 ; i < info[2] ; i++) {
-		if (memcmp(memory[bank][blk][i].data, initial_data, sizeof(initial_data)) ||
-			memcmp(memory[bank][blk][i].spare, initial_spare, sizeof(initial_spare)))
+	for (int i = 0 ; i < nand->info[2] ; i++) {
+		if (memcmp(nand->memory[bank][blk][i].data, initial_data, sizeof(initial_data)) ||
+			memcmp(nand->memory[bank][blk][i].spare, initial_spare, sizeof(initial_spare)))
 		{
             if (i == page - 1)
                 break;
             else
                 NAND_ERR_POSITION;
 		}
-		if (i == info[2] - 1 && page != 0) 
+		if (i == nand->info[2] - 1 && page != 0) 
 		{
 			return NAND_ERR_POSITION;
 		}
 	}
 	*/
-	for (int i = 0 ; i < info[2] ; i++) {
-		if (meta_data[bank][blk][i] == true)
+	for (int i = 0 ; i < nand->info[2] ; i++) {
+		if (nand->meta_data[bank][blk][i] == true)
 		{
             if (i == page - 1)
                 break;
             else
                 NAND_ERR_POSITION;
 		}
-		if (i == info[2] - 1 && page != 0) 
+		if (i == nand->info[2] - 1 && page != 0) 
 		{
 			printf("+ [%d] ", page);
 			return NAND_ERR_POSITION;
 		}
 	}
 
-	memcpy(memory[bank][blk][page].data, data, sizeof(memory[bank][blk][page].data));
-	memcpy(memory[bank][blk][page].spare, spare, sizeof(memory[bank][blk][page].spare));
+	memcpy(nand->memory[bank][blk][page].data, data, sizeof(nand->memory[bank][blk][page].data));
+	memcpy(nand->memory[bank][blk][page].spare, spare, sizeof(nand->memory[bank][blk][page].spare));
+	nand_charge(nand, bank, nand->t_prog, true, true);
 
-	pre_write[0] = bank;
-	pre_write[1] = blk;
-	pre_write[2] = page;
-	pre_write[3] = WRITING;
+	nand->pre_write[bank][0] = bank;
+	nand->pre_write[bank][1] = blk;
+	nand->pre_write[bank][2] = page;
+	nand->pre_write[bank][3] = WRITING;
 
-	meta_data[bank][blk][page] = true;
+	nand->meta_data[bank][blk][page] = true;
 
-	u32 a = memory[bank][blk][page].spare[0];
+	u32 a = nand->memory[bank][blk][page].spare[0];
 /* 	if (a == 3583) {
 		printf("+++ \n\n\n\n");
 					for (int n = 0 ; n < SECTORS_PER_PAGE ; n++)
-						printf("%2x ", memory[bank][blk][page].data[n]);
+						printf("%2x ", nand->memory[bank][blk][page].data[n]);
 		} */
 	
 
@@ -197,7 +423,7 @@ int nand_write(int bank, int blk, int page, void *data, void *spare)
 			for (int l = 0 ; l < BLKS_PER_BANK ; l++) {
 				for (int m = 0 ; m < PAGES_PER_BLK ; m++) {
 					for (int n = 0 ; n < SECTORS_PER_PAGE ; n++)
-						printf("%2x ", memory[k][l][m].data[n]);
+						printf("%2x ", nand->memory[k][l][m].data[n]);
 				}
 				printf("\n\n");
 			}
@@ -219,29 +445,30 @@ int nand_write(int bank, int blk, int page, void *data, void *spare)
  *   NAND_ERR_INVALID if target flash page address is invalid
  *   NAND_ERR_EMPTY if target page is empty
  */
-int nand_read(int bank, int blk, int page, void *data, void *spare)
+int nand_read(struct nand_device *nand, int bank, int blk, int page, void *data, void *spare)
 {
 	if (bank < 0 || blk < 0 || page < 0 ||
-		bank >= info[0] || blk >= info[1] || page >= info[2]) {
+		bank >= nand->info[0] || blk >= nand->info[1] || page >= nand->info[2]) {
 		return NAND_ERR_INVALID;
 	}
 
-	pre_write[3] = NOWRITING;
+	nand->pre_write[bank][3] = NOWRITING;
+	nand_charge(nand, bank, nand->t_read, true, false);
 	
 	/*
-	if (!memcmp(memory[bank][blk][page].data, initial_data, sizeof(initial_data)) &&
-		!memcmp(memory[bank][blk][page].spare, initial_spare, sizeof(initial_spare))) 
+	if (!memcmp(nand->memory[bank][blk][page].data, initial_data, sizeof(initial_data)) &&
+		!memcmp(nand->memory[bank][blk][page].spare, initial_spare, sizeof(initial_spare))) 
 	{
 		return NAND_ERR_EMPTY;
 	}
 	*/
 
-	if (meta_data[bank][blk][page] == false) {
+	if (nand->meta_data[bank][blk][page] == false) {
 		return NAND_ERR_EMPTY;
 	}
 
-	memcpy(data, memory[bank][blk][page].data, sizeof(memory[bank][blk][page].data));
-	memcpy(spare, memory[bank][blk][page].spare, sizeof(memory[bank][blk][page].spare));
+	memcpy(data, nand->memory[bank][blk][page].data, sizeof(nand->memory[bank][blk][page].data));
+	memcpy(spare, nand->memory[bank][blk][page].spare, sizeof(nand->memory[bank][blk][page].spare));
 
 	return NAND_SUCCESS;
 }
@@ -254,40 +481,41 @@ int nand_read(int bank, int blk, int page, void *data, void *spare)
  *   NAND_ERR_INVALID if target flash block address is invalid
  *   NAND_ERR_EMPTY if target block is already erased
  */
-int nand_erase(int bank, int blk)
+int nand_erase(struct nand_device *nand, int bank, int blk)
 {
-	pre_write[3] = NOWRITING;
 	if (bank < 0 || blk < 0 ||
-		bank >= info[0] || blk >= info[1]) {
+		bank >= nand->info[0] || blk >= nand->info[1]) {
 		return NAND_ERR_INVALID;
 	}
+	nand->pre_write[bank][3] = NOWRITING;
 
 	/*
-	for (int i = 0 ; i < info[2] ; i++) {
-		if (memcmp(memory[bank][blk][i].data, initial_data, sizeof(initial_data)) ||
-			memcmp(memory[bank][blk][i].spare, initial_spare, sizeof(initial_spare)))
+	for (int i = 0 ; i < nand->info[2] ; i++) {
+		if (memcmp(nand->memory[bank][blk][i].data, initial_data, sizeof(initial_data)) ||
+			memcmp(nand->memory[bank][blk][i].spare, initial_spare, sizeof(initial_spare)))
 		{
 			break;
 		}
-		if (i == info[2] - 1) 
+		if (i == nand->info[2] - 1) 
 			return NAND_ERR_EMPTY;
 	}
 	*/
-	for (int i = 0 ; i < info[2] ; i++) {
-		if (meta_data[bank][blk][i] == true)
+	for (int i = 0 ; i < nand->info[2] ; i++) {
+		if (nand->meta_data[bank][blk][i] == true)
 		{
 			break;
 		}
-		if (i == info[2] - 1) 
+		if (i == nand->info[2] - 1) 
 			return NAND_ERR_EMPTY;
 	}
 
 	
-	for (int i = 0 ; i < info[2] ; i++) {
-		memcpy(memory[bank][blk][i].data, initial_data, sizeof(initial_data));
-		memcpy(memory[bank][blk][i].spare, initial_spare, sizeof(initial_spare));
+	nand_charge(nand, bank, nand->t_erase, false, false);
+	for (int i = 0 ; i < nand->info[2] ; i++) {
+		memset(nand->memory[bank][blk][i].data, 0xff, sizeof(nand->memory[bank][blk][i].data));
+		memset(nand->memory[bank][blk][i].spare, 0xff, sizeof(nand->memory[bank][blk][i].spare));
 
-		meta_data[bank][blk][i] = false;
+		nand->meta_data[bank][blk][i] = false;
 	}
 
 	return NAND_SUCCESS;
@@ -14,11 +14,36 @@
 #define PAGE_DATA_SIZE		32
 #define PAGE_SPARE_SIZE		4
 
+/* NAND flash instance */
+struct nand_device;
+
+/*
+ * Timing
+ *
+ * Banks are the dies of a channel/way topology: bank b is way
+ * b / nchannels on channel b % nchannels. Array operations (read,
+ * program, erase) keep only their die busy, page transfers to and from
+ * a die hold its channel bus, so dies of one channel share it.
+ * A read senses the page then transfers it out, a program transfers it
+ * in then programs. Every operation starts at the clock set by
+ * nand_set_clock, or later when its die or channel is still busy.
+ * Times are in ns, and nothing is timed before the clock is first set.
+ */
+void nand_set_timing(struct nand_device *nand, unsigned int t_read, unsigned int t_prog, unsigned int t_erase, unsigned int t_xfer);
+int nand_set_channels(struct nand_device *nand, int nchannels);
+void nand_set_clock(struct nand_device *nand, unsigned long long now);
+unsigned long long nand_last_end(struct nand_device *nand);
+unsigned long long nand_bank_free(struct nand_device *nand, int bank);
+unsigned long long nand_bank_busy(struct nand_device *nand, int bank);
+unsigned long long nand_bank_work(struct nand_device *nand, int bank);
+unsigned long long nand_channel_busy(struct nand_device *nand, int channel);
+
 /* function prototypes */
-int nand_init(int nbanks, int nblks, int npages);
-int nand_read(int bank, int blk, int page, void *data, void *spare);
-int nand_write(int bank, int blk, int page, void *data, void *spare);
-int nand_erase(int bank, int blk);
+int nand_init(struct nand_device **nand, int nbanks, int nblks, int npages);
+void nand_close(struct nand_device *nand);
+int nand_read(struct nand_device *nand, int bank, int blk, int page, void *data, void *spare);
+int nand_write(struct nand_device *nand, int bank, int blk, int page, void *data, void *spare);
+int nand_erase(struct nand_device *nand, int bank, int blk);
 
 /* return code */
 #define NAND_SUCCESS		0